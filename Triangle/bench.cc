@@ -0,0 +1,200 @@
+// Decode timings for stb_image.h. `make bench` builds this twice, as bench
+// (AVX2 kernels compiled in, used when the CPU has them) and bench_sse2
+// (-DSTBI_NO_AVX2), so the two IDCT paths can be compared on one machine:
+//
+//   ./bench photo.jpg progressive.jpg
+//   ./bench_sse2 photo.jpg progressive.jpg
+//
+// Every figure is the best of several runs, to keep scheduler noise out.
+//
+// JPEGs are also decoded at 1/2, 1/4 and 1/8 scale, and compared with the
+// full-size decode averaged down over each scale x scale box. The exit code
+// is 1 if one of them is further off than kMinPsnr allows, so
+// `make check IMAGES="a.jpg b.jpg"` can be used as a test.
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+using std::printf;
+
+const int kRuns = 20;
+// the reduced IDCTs can't reproduce what the full-size upsampling filters
+// do, so the two never match exactly; 22 dB is well below what correct
+// decodes score and well above a plane that's a scale step off. outputs
+// smaller than kMinCheckSize on a side are mostly edge pixels and aren't
+// checked
+const double kMinPsnr = 22;
+const int kMinCheckSize = 16;
+
+double Now()
+{
+  using namespace std::chrono;
+  return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+std::vector<stbi_uc> ReadFile(const char *name)
+{
+  std::vector<stbi_uc> data;
+  if (FILE *f = std::fopen(name, "rb"))
+  {
+    std::fseek(f, 0, SEEK_END);
+    data.resize(std::ftell(f));
+    std::fseek(f, 0, SEEK_SET);
+    data.resize(std::fread(data.data(), 1, data.size(), f));
+    std::fclose(f);
+  }
+  return data;
+}
+
+#ifdef STBI_AVX2
+// The IDCT on its own, on sparse blocks (only the low frequencies set, as in
+// most photos) and on dense ones (high quality settings, noisy images).
+void BenchIdct()
+{
+  const int kBlocks = 4096;
+  static short blocks[kBlocks][64];
+  static stbi_uc out[2][64];
+  if (!stbi__avx2_available())
+  {
+    printf("idct: this CPU has no AVX2\n");
+    return;
+  }
+  unsigned seed = 1;
+  for (int sparse = 1; sparse >= 0; sparse--)
+  {
+    for (int i = 0; i < kBlocks; i++)
+      for (int k = 0; k < 64; k++)
+      {
+        seed = seed * 1103515245u + 12345u;
+        int r = (int)(seed >> 16);
+        if (k == 0)
+          blocks[i][k] = (short)(r % 2000 - 1000);
+        else if (!sparse || stbi__jpeg_dezigzag[k] < 10)
+          blocks[i][k] = (short)(r % 400 - 200);
+        else
+          blocks[i][k] = 0;
+      }
+    double sse2 = 1e30, avx2 = 1e30;
+    for (int run = 0; run < kRuns; run++)
+    {
+      double t = Now();
+      for (int i = 0; i < kBlocks; i++)
+        stbi__idct_simd(out[i & 1], 8, blocks[i]);
+      t = Now() - t;
+      if (t < sse2)
+        sse2 = t;
+      t = Now();
+      for (int i = 0; i < kBlocks; i += 2)
+        stbi__idct2_avx2(out[0], out[1], 8, blocks[i]);
+      t = Now() - t;
+      if (t < avx2)
+        avx2 = t;
+    }
+    printf("idct, %s blocks: SSE2 %.1f ns/block, AVX2 %.1f ns/block\n",
+           sparse ? "sparse" : "dense", sse2 * 1e6 / kBlocks, avx2 * 1e6 / kBlocks);
+  }
+}
+#endif
+
+// PSNR of a scaled decode against the full-size one averaged over boxes
+double ScaledPsnr(const stbi_uc *full, int w, int h, const stbi_uc *scaled, int sw, int sh, int n, int scale)
+{
+  double err = 0;
+  for (int y = 0; y < sh; y++)
+    for (int x = 0; x < sw; x++)
+      for (int c = 0; c < n; c++)
+      {
+        int sum = 0, count = 0;
+        for (int yy = y * scale; yy < (y + 1) * scale && yy < h; yy++)
+          for (int xx = x * scale; xx < (x + 1) * scale && xx < w; xx++, count++)
+            sum += full[(yy * w + xx) * n + c];
+        double d = (double)sum / count - scaled[(y * sw + x) * n + c];
+        err += d * d;
+      }
+  err /= (double)sw * sh * n;
+  return err > 0 ? 10 * std::log10(255.0 * 255.0 / err) : 99;
+}
+
+// returns false if a scaled decode is off by more than kMinPsnr allows
+bool BenchScaled(const char *name, const std::vector<stbi_uc> &file, const stbi_uc *full, int w, int h, int n)
+{
+  bool ok = true;
+  for (int scale = 2; scale <= 8; scale *= 2)
+  {
+    double best = 1e30;
+    int sw = 0, sh = 0, sn;
+    stbi_uc *pixels = nullptr;
+    for (int run = 0; run < kRuns; run++)
+    {
+      stbi_image_free(pixels);
+      double t = Now();
+      pixels = stbi_load_scaled_from_memory(file.data(), (int)file.size(), &sw, &sh, &sn, n, scale);
+      t = Now() - t;
+      if (!pixels)
+        break;
+      if (t < best)
+        best = t;
+    }
+    // other formats come back at full size
+    if (!pixels || sw != (w + scale - 1) / scale || sh != (h + scale - 1) / scale)
+    {
+      stbi_image_free(pixels);
+      return ok;
+    }
+    double psnr = ScaledPsnr(full, w, h, pixels, sw, sh, n, scale);
+    bool checked = sw >= kMinCheckSize && sh >= kMinCheckSize;
+    printf("%s: 1/%d, %dx%d, %.2f ms, %.1f dB%s\n", name, scale, sw, sh, best, psnr,
+           !checked ? "" : psnr < kMinPsnr ? " FAIL" : " ok");
+    if (checked && psnr < kMinPsnr)
+      ok = false;
+    stbi_image_free(pixels);
+  }
+  return ok;
+}
+
+bool BenchFile(const char *name)
+{
+  std::vector<stbi_uc> file = ReadFile(name);
+  int w, h, n;
+  if (file.empty() || !stbi_info_from_memory(file.data(), (int)file.size(), &w, &h, &n))
+  {
+    printf("%s: can't read\n", name);
+    return false;
+  }
+  double best = 1e30;
+  stbi_uc *pixels = nullptr;
+  for (int run = 0; run < kRuns; run++)
+  {
+    stbi_image_free(pixels);
+    double t = Now();
+    pixels = stbi_load_from_memory(file.data(), (int)file.size(), &w, &h, &n, 0);
+    t = Now() - t;
+    if (!pixels)
+    {
+      printf("%s: %s\n", name, stbi_failure_reason());
+      return false;
+    }
+    if (t < best)
+      best = t;
+  }
+  printf("%s: %dx%d, %.2f ms\n", name, w, h, best);
+  bool ok = BenchScaled(name, file, pixels, w, h, n);
+  stbi_image_free(pixels);
+  return ok;
+}
+
+int main(int argc, const char **argv)
+{
+#ifdef STBI_AVX2
+  BenchIdct();
+#else
+  printf("idct: built without AVX2, SSE2 only\n");
+#endif
+  bool ok = true;
+  for (int i = 1; i < argc; i++)
+    ok = BenchFile(argv[i]) && ok;
+  return ok ? 0 : 1;
+}
@@ -5,6 +5,7 @@
 #include <vector>
 #include <glm/gtx/transform.hpp>
 #define STB_IMAGE_IMPLEMENTATION
+#define STBI_THREADS
 #include "stb_image.h"
 
 using std::printf;
@@ -15,6 +16,19 @@ GLuint shaderProgram = 0;
 GLuint VAO;
 GLuint VBO;
 GLuint texture;
+GLuint planeTextures[3];
+int numPlanes = 0; // 0: RGB texture, 1: Y plane, 3: Y, Cb and Cr planes
+vec2 chromaScale(1);
+
+// box.gif, if there is one, is decoded a frame at a time and cycled through
+// a few textures, so uploading a frame never waits for the GPU to finish
+// drawing with the one before it
+const int kGifTextures = 3;
+std::vector<stbi_uc> gifFile;
+stbi_gif_stream *gif = nullptr;
+GLuint gifTextures[kGifTextures];
+int gifSlot = 0, gifW = 0, gifH = 0;
+double gifNextFrame = 0;
 
 struct VertexAttrib
 {
@@ -27,6 +41,9 @@ bool use_my_mat = true;
 GLuint LoadShader(GLenum shaderType, const char *shaderSrc);
 GLuint CreateShaderProgram();
 void InitializeResource();
+bool InitializeGif();
+bool InitializeHdr();
+void AdvanceGif(double now);
 
 void OnKey(GLFWwindow *, int key, int scancode, int action, int mod)
 {
@@ -66,6 +83,9 @@ int main(int argc, const char **argv)
   }
 
   InitializeResource();
+  // the JPEG and PNG loads cache their temporaries for the next load; nothing
+  // after this point decodes an image, so hand them back
+  stbi_release_scratch();
 
   while (!glfwWindowShouldClose(window))
   {
@@ -81,6 +101,9 @@ int main(int argc, const char **argv)
 
       glUseProgram(shaderProgram);
 
+      if (gif)
+        AdvanceGif(glfwGetTime());
+
       glm::vec2 offset;
       offset.x = glm::sin(glfwGetTime()) * 0.5;
       offset.y = glm::cos(glfwGetTime()) * 0.5;
@@ -151,10 +174,26 @@ int main(int argc, const char **argv)
         glUniformMatrix4fv(projection_loc, 1, GL_FALSE, (float *)&glm_P);
       }
 
-      glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D,texture);
-      int tex_loc = glGetUniformLocation(shaderProgram, "tex");
-      glUniform1i(tex_loc, 0);
+      int planes_loc = glGetUniformLocation(shaderProgram, "planes");
+      glUniform1i(planes_loc, numPlanes);
+      if (numPlanes)
+      {
+        const char *names[3] = {"texY", "texCb", "texCr"};
+        for (int i = 0; i < numPlanes; i++)
+        {
+          glActiveTexture(GL_TEXTURE0 + i);
+          glBindTexture(GL_TEXTURE_2D, planeTextures[i]);
+          glUniform1i(glGetUniformLocation(shaderProgram, names[i]), i);
+        }
+        glUniform2fv(glGetUniformLocation(shaderProgram, "chromaScale"), 1, (float *)&chromaScale);
+      }
+      else
+      {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D,texture);
+        int tex_loc = glGetUniformLocation(shaderProgram, "tex");
+        glUniform1i(tex_loc, 0);
+      }
 
       glBindVertexArray(VAO);
 
@@ -163,6 +202,7 @@ int main(int argc, const char **argv)
     glfwSwapBuffers(window);
   }
 
+  stbi_gif_stream_close(gif);
   glfwTerminate();
   return 0;
 }
@@ -207,18 +247,62 @@ void InitializeResource()
   glVertexAttribPointer(uvLoc, 2, GL_FLOAT, GL_FALSE, sizeof(VertexAttrib), (void *)(sizeof(vec3)));
   glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+  if (!InitializeGif() && !InitializeHdr())
   {
     int w=0,h=0;
-    unsigned char *pixels = stbi_load("box.jpg",&w,&h,0,3);
+    // upload the YCbCr planes as they come out of the decoder and convert
+    // in the fragment shader; for 4:2:0 that's half the bytes of RGB and
+    // no color conversion on the CPU
+    stbi_planes planes;
+    unsigned char *pixels = stbi_load_ycbcr("box.jpg",&w,&h,&planes);
     if(pixels)
     {
-      glGenTextures(1,&texture);
-      glBindTexture(GL_TEXTURE_2D,texture);
-      glTexImage2D(GL_TEXTURE_2D,0,GL_RGB8,w,h,0,GL_RGB,GL_UNSIGNED_BYTE,pixels);
-      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_LINEAR);
-      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);  
-      glGenerateMipmap(GL_TEXTURE_2D);
+      numPlanes = planes.num_planes;
+      glGenTextures(numPlanes,planeTextures);
+      glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+      for (int i = 0; i < numPlanes; i++)
+      {
+        glBindTexture(GL_TEXTURE_2D,planeTextures[i]);
+        glTexImage2D(GL_TEXTURE_2D,0,GL_R8,planes.w[i],planes.h[i],0,GL_RED,GL_UNSIGNED_BYTE,planes.plane[i]);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+        glGenerateMipmap(GL_TEXTURE_2D);
+      }
+      glPixelStorei(GL_UNPACK_ALIGNMENT,4);
+      if (numPlanes == 3)
+      {
+        // a chroma plane of an odd-sized image has half a sample of padding
+        // at its end, so map luma coordinates onto it explicitly
+        int hs = (w + planes.w[1] - 1) / planes.w[1], vs = (h + planes.h[1] - 1) / planes.h[1];
+        chromaScale = vec2(float(w) / (hs * planes.w[1]), float(h) / (vs * planes.h[1]));
+      }
     }
+    else if (stbi_info("box.jpg",&w,&h,0))
+    {
+      // not a YCbCr JPEG: decode straight into a mapped unpack buffer, with
+      // rows padded to the default GL_UNPACK_ALIGNMENT of 4
+      int pitch = (w * 3 + 3) & ~3;
+      GLuint pbo;
+      glGenBuffers(1,&pbo);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER,pbo);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER,pitch * h,nullptr,GL_STREAM_DRAW);
+      void *dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,0,pitch * h,GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+      int ok = dest && stbi_load_into("box.jpg",dest,pitch * h,pitch,&w,&h,0,3);
+      if (dest && glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) && ok)
+      {
+        glGenTextures(1,&texture);
+        glBindTexture(GL_TEXTURE_2D,texture);
+        glTexImage2D(GL_TEXTURE_2D,0,GL_RGB8,w,h,0,GL_RGB,GL_UNSIGNED_BYTE,nullptr);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+        glGenerateMipmap(GL_TEXTURE_2D);
+      }
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER,0);
+      glDeleteBuffers(1,&pbo);
+    }
+    stbi_image_free(pixels);
   }
 
   glClearColor(0.2, 0.3, 0.4, 1);
@@ -228,6 +312,89 @@ void InitializeResource()
   glDepthFunc(GL_GEQUAL);
 }
 
+bool InitializeGif()
+{
+  if (FILE *f = std::fopen("box.gif", "rb"))
+  {
+    std::fseek(f, 0, SEEK_END);
+    gifFile.resize(std::ftell(f));
+    std::fseek(f, 0, SEEK_SET);
+    gifFile.resize(std::fread(gifFile.data(), 1, gifFile.size(), f));
+    std::fclose(f);
+  }
+  if (gifFile.empty())
+    return false;
+  gif = stbi_gif_stream_open_from_memory(gifFile.data(), (int)gifFile.size(), &gifW, &gifH, 0, 4);
+  if (!gif)
+    return false;
+
+  glGenTextures(kGifTextures, gifTextures);
+  for (int i = 0; i < kGifTextures; i++)
+  {
+    glBindTexture(GL_TEXTURE_2D, gifTextures[i]);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, gifW, gifH);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+  gifSlot = kGifTextures - 1;
+  gifNextFrame = glfwGetTime();
+  AdvanceGif(gifNextFrame);
+  return gif != nullptr;
+}
+
+void AdvanceGif(double now)
+{
+  if (now < gifNextFrame)
+    return;
+  int delay = 0;
+  const stbi_uc *frame = stbi_gif_stream_next(gif, &delay);
+  if (!frame)
+  {
+    // end of the animation: start over
+    stbi_gif_stream_close(gif);
+    gif = stbi_gif_stream_open_from_memory(gifFile.data(), (int)gifFile.size(), &gifW, &gifH, 0, 4);
+    frame = gif ? stbi_gif_stream_next(gif, &delay) : nullptr;
+    if (!frame)
+    {
+      printf("box.gif: %s\n", stbi_failure_reason());
+      stbi_gif_stream_close(gif);
+      gif = nullptr;
+      return;
+    }
+  }
+  gifSlot = (gifSlot + 1) % kGifTextures;
+  texture = gifTextures[gifSlot];
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, gifW, gifH, GL_RGBA, GL_UNSIGNED_BYTE, frame);
+  // like browsers, treat very short delays as 100ms; if we fell far behind
+  // (window dragged, say), don't race to catch up
+  gifNextFrame += (delay > 10 ? delay : 100) / 1000.0;
+  if (gifNextFrame < now)
+    gifNextFrame = now;
+}
+
+bool InitializeHdr()
+{
+  // box.hdr goes straight from the decoder to a GL_RGB9_E5 texture, 4 bytes
+  // a pixel instead of 12 for floats, with no conversion on the way
+  int w = 0, h = 0;
+  void *pixels = stbi_load_hdr("box.hdr", &w, &h, STBI_hdr_rgb9e5);
+  if (!pixels)
+    return false;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB9_E5, w, h, 0, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, pixels);
+  // RGB9_E5 isn't color-renderable, so glGenerateMipmap may reject it, and
+  // a mipmap min filter would then leave the texture incomplete: sample the
+  // base level only
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  stbi_image_free(pixels);
+  return true;
+}
+
 GLuint LoadShader(GLenum shaderType, const char *shaderSrc)
 {
   GLuint shader = glCreateShader(shaderType);
@@ -271,10 +438,27 @@ in vec2 vsUv;
 out vec4 fragColor;
 
 uniform sampler2D tex;
+uniform sampler2D texY;
+uniform sampler2D texCb;
+uniform sampler2D texCr;
+uniform int planes; // 0: RGB in tex, 1: Y plane, 3: Y, Cb and Cr planes
+uniform vec2 chromaScale;
 
 void main()
 {
-  fragColor=texture(tex,vsUv);
+  if (planes == 0)
+  {
+    fragColor=texture(tex,vsUv);
+  }
+  else
+  {
+    // full range JFIF YCbCr
+    float y = texture(texY,vsUv).r;
+    vec2 c = vec2(0);
+    if (planes == 3)
+      c = vec2(texture(texCb,vsUv*chromaScale).r, texture(texCr,vsUv*chromaScale).r) - 128.0/255.0;
+    fragColor=vec4(y + 1.402*c.y, y - 0.344136*c.x - 0.714136*c.y, y + 1.772*c.x, 1);
+  }
 }
   )";
 
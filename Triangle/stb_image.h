@@ -267,12 +267,57 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// Where AVX2 is available, the JPEG IDCT additionally transforms two blocks
+// per call. AVX2 support is always checked at run-time, including on GCC and
+// Clang, where the AVX2 kernels get a per-function target attribute instead
+// of requiring -mavx2 for the whole file. Define STBI_NO_AVX2 to leave the
+// AVX2 kernels out and use only SSE2.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
 // ===========================================================================
 //
+// Multi-threading
+//
+// If you define STBI_THREADS in the file that defines STB_IMAGE_IMPLEMENTATION,
+// stb_image will split some of the decoding work across worker threads, using
+// pthreads (link with -pthread) or the Win32 thread API. The threads only live
+// for the duration of a single stbi_load call. Currently this applies to:
+//
+//   - baseline JPEGs with restart markers (DRI) loaded from memory: the
+//     segments between RSTn markers are entropy-decoded in parallel
+//   - the IDCT of progressive JPEGs
+//   - JPEG upsampling and color conversion, in bands of rows
+//   - large non-interlaced PNGs: one thread inflates into a small ring of
+//     scanlines while another unfilters them, instead of inflating the
+//     whole image first
+//
+// The number of threads defaults to the number of CPUs; you can change it with
+//
+//     stbi_set_thread_count(n);   // 1 disables threading, 0 restores default
+//
+// Images under about 64K pixels per thread use fewer threads, or none, since
+// starting a thread would cost more than it saves. Results are identical to
+// single-threaded decoding.
+//
+// ===========================================================================
+//
+// Memory-mapped files
+//
+// On Windows and POSIX systems the functions that take a filename (stbi_load,
+// stbi_load_16, stbi_loadf, stbi_info, ...) map the file into memory (or,
+// below 256KB, read it whole with one call) and decode it exactly like
+// stbi_load_from_memory, which also lets them use the memory-only threaded
+// paths above. Pipes, devices, empty files and
+// files over 2GB are read through stdio as before, as is anything passed
+// in as a FILE*. Define STBI_NO_MMAP to always use stdio. Note that if the
+// file is truncated by another process while it is mapped, the read may
+// fault (SIGBUS) instead of reporting a truncated image.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image supports loading HDR images in general, and currently the Radiance
@@ -430,10 +475,273 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
 
+// like the above, but JPEGs are decoded directly at 1/scale of their size
+// (scale = 1, 2, 4 or 8), which is much cheaper than decoding at full size
+// and resizing; *x and *y are the reduced size. Other formats are loaded
+// at full size.
+STBIDEF stbi_uc *stbi_load_scaled_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+STBIDEF stbi_uc *stbi_load_scaled_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+STBIDEF stbi_uc *stbi_load_scaled_from_file(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+#endif
+
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
 
+////////////////////////////////////
+//
+// row-streaming interface
+//
+// Instead of returning the whole image, these hand it to you a few rows at a
+// time, so you can write them straight to their destination. 'begin' is
+// called once the size is known; 'rows' gets num_rows rows of x*channels
+// bytes starting at row y (with vertical flipping on, one row per call, with
+// y already flipped). Return 0 from either to stop decoding.
+//
+// Baseline JPEGs and non-interlaced PNGs are decoded incrementally and only
+// keep a few rows of decoded data around (PNGs still buffer the compressed
+// IDAT data; progressive JPEGs still need their coefficients). Other images
+// are decoded whole and then handed out in one call. Returns 1 on success.
+
+typedef struct
+{
+   int      (*begin) (void *user, int x, int y, int channels_in_file, int channels);
+   int      (*rows)  (void *user, int y, int num_rows, stbi_uc const *data);
+} stbi_row_callbacks;
+
+STBIDEF int stbi_load_rows_from_memory   (stbi_uc           const *buffer, int len   , stbi_row_callbacks const *rcb, void *rows_user, int desired_channels);
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk  , void *user, stbi_row_callbacks const *rcb, void *rows_user, int desired_channels);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows          (char const *filename, stbi_row_callbacks const *rcb, void *rows_user, int desired_channels);
+STBIDEF int stbi_load_rows_from_file(FILE *f,              stbi_row_callbacks const *rcb, void *rows_user, int desired_channels);
+#endif
+
+// region-of-interest interface: returns only the rw x rh pixels at rx,ry
+// (in the image as stored, top row first; the tile comes out flipped if
+// vertical flipping is on). *x and *y are the size of the whole image. The
+// region must lie inside the image.
+//
+// Baseline JPEGs still read the entropy-coded data up to the last needed
+// MCU row but only reconstruct the MCUs around the region, progressive ones
+// only inverse-transform those. Non-interlaced PNGs stop inflating after the
+// last needed row. Other images are decoded whole and cropped.
+
+STBIDEF stbi_uc *stbi_load_region_from_memory   (stbi_uc           const *buffer, int len   , int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region          (char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_region_from_file(FILE *f,              int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+// decode-into interface: writes the image into memory you provide (a mapped
+// pixel unpack buffer, a slice of a staging buffer, ...) instead of returning
+// a new block. Rows start pitch bytes apart; 0 means tightly packed (x times
+// the number of channels), anything larger pads the rows, e.g. to
+// GL_UNPACK_ALIGNMENT, or places the image inside a wider one. Only the
+// pixels are written, never the bytes between rows. dest_size is the number
+// of bytes at dest; if pitch*(y-1) + x*channels is more than that, the load
+// fails before writing anything (use stbi_info to size the buffer). With
+// vertical flipping on, the bottom row is written first. Returns 1 on
+// success; a failed load may have written part of the image.
+//
+// Baseline JPEGs convert their rows straight into the destination, and
+// non-interlaced PNGs store each row as soon as it is complete, so neither
+// allocates the whole image. Other images are decoded whole and copied.
+
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into          (char const *filename, void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int stbi_load_into_from_file(FILE *f,              void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+////////////////////////////////////
+//
+// decoder objects
+//
+// With many small images, setting up the decoder (building Huffman tables,
+// mostly) costs more than decoding the pixels. A stbi_decoder keeps that
+// state between the images loaded through it: JPEG Huffman tables are only
+// rebuilt when an image defines different ones (images from the same encoder
+// usually don't), the fixed zlib tables of PNGs are built once and the last
+// dynamic ones are reused when the next image sends the same code lengths,
+// and the SIMD kernels are picked once. It also keeps the large temporary
+// buffers of a load (JPEG planes and coefficients, PNG compressed and
+// inflated data) for the next one, instead of allocating and page-faulting
+// them again, up to STBI_SCRATCH_LIMIT bytes (default 64MB, 0 disables
+// this). stbi_decoder_destroy frees everything it keeps.
+//
+// A decoder may be used by one thread at a time, and loads give the same
+// results as the corresponding stbi_load* call; free images with
+// stbi_image_free as usual.
+
+typedef struct stbi__decoder stbi_decoder;
+
+STBIDEF stbi_decoder *stbi_decoder_create (void);
+STBIDEF void          stbi_decoder_destroy(stbi_decoder *dec);
+
+STBIDEF stbi_uc *stbi_decoder_load_from_memory        (stbi_decoder *dec, stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_decoder_load_from_callbacks     (stbi_decoder *dec, stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_decoder_load_into_from_memory   (stbi_decoder *dec, stbi_uc           const *buffer, int len   , void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_decoder_load_into_from_callbacks(stbi_decoder *dec, stbi_io_callbacks const *clbk  , void *user, void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_decoder_load     (stbi_decoder *dec, char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_decoder_load_into(stbi_decoder *dec, char const *filename, void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+////////////////////////////////////
+//
+// per-call options
+//
+// The stbi_set_* functions (and stbi_convert_iphone_png_to_rgb, and the
+// gamma/scale functions of the float interfaces) change settings for every
+// load in the process, or with their _thread versions for every load on the
+// calling thread. The _ex functions take all of them per call instead, so
+// threads can decode with different settings without touching any shared
+// state. stbi_load_options_init fills in the settings currently in effect on
+// the calling thread; change what you need from there. The options are only
+// read during the call, and a NULL options pointer means the current
+// settings, so the _ex functions then behave like the plain ones.
+
+typedef struct
+{
+   int flip_vertically;     // stbi_set_flip_vertically_on_load
+   int unpremultiply;       // stbi_set_unpremultiply_on_load
+   int convert_iphone_png;  // stbi_convert_iphone_png_to_rgb
+   int half_float;          // stbi_set_half_float_on_load (stbi_load_16*_ex only)
+   float ldr_to_hdr_gamma;  // stbi_ldr_to_hdr_gamma (stbi_loadf*_ex only)
+   float ldr_to_hdr_scale;  // stbi_ldr_to_hdr_scale
+   float hdr_to_ldr_gamma;  // stbi_hdr_to_ldr_gamma (8-bit loads of HDR files)
+   float hdr_to_ldr_scale;  // stbi_hdr_to_ldr_scale
+   int jpeg_scale;          // 1, 2, 4 or 8, as for stbi_load_scaled; 1 after init
+   stbi_decoder *decoder;   // as for stbi_decoder_load*; NULL after init
+} stbi_load_options;
+
+STBIDEF void stbi_load_options_init(stbi_load_options *opt);
+
+STBIDEF stbi_uc *stbi_load_from_memory_ex        (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF stbi_uc *stbi_load_from_callbacks_ex     (stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF stbi_us *stbi_load_16_from_memory_ex     (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF stbi_us *stbi_load_16_from_callbacks_ex  (stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF int      stbi_load_into_from_memory_ex   (stbi_uc           const *buffer, int len   , void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF int      stbi_load_into_from_callbacks_ex(stbi_io_callbacks const *clbk  , void *user, void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+#ifndef STBI_NO_LINEAR
+STBIDEF float   *stbi_loadf_from_memory_ex       (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF float   *stbi_loadf_from_callbacks_ex    (stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+#endif
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ex     (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF stbi_us *stbi_load_16_ex  (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+STBIDEF int      stbi_load_into_ex(char const *filename, void *dest, int dest_size, int pitch, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+#ifndef STBI_NO_LINEAR
+STBIDEF float   *stbi_loadf_ex    (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *opt);
+#endif
+#endif
+
+////////////////////////////////////
+//
+// batch loading
+//
+// stbi_load_batch loads a list of images, each from a file (filename) or
+// from memory (buffer and len, with filename NULL), and fills in each item
+// with what stbi_load_ex would have returned for it: the image (free it with
+// stbi_image_free) and its size, or NULL and the failure reason. Items come
+// back in the order given, and the return value is the number loaded. A
+// NULL options pointer means the calling thread's current settings.
+//
+// With STBI_THREADS, the images are spread over stbi_set_thread_count
+// threads (the calling one included), which only live for the call. Each
+// thread decodes a run of consecutive items through its own stbi_decoder,
+// so small images sharing tables stay cheap; a thread that runs out steals
+// half of the longest run left. Once nothing is left to steal, idle threads
+// help the ones still busy with a large image, the same way stbi_load
+// splits it over threads (restart intervals, bands of rows). The decoders
+// of the other threads are destroyed when the call returns. opt->decoder,
+// if set, is only used by the calling thread. Without STBI_THREADS this is
+// a loop on the calling thread.
+
+typedef struct
+{
+   char const *filename;        // file to load, or NULL to use buffer and len
+   stbi_uc const *buffer;
+   int len;
+   stbi_uc *data;               // out: the image, or NULL if it failed
+   int x, y, channels_in_file;  // out
+   char const *failure_reason;  // out: as stbi_failure_reason, if data is NULL
+} stbi_batch_item;
+
+STBIDEF int stbi_load_batch(stbi_batch_item *items, int count, int desired_channels, stbi_load_options const *opt);
+
+////////////////////////////////////
+//
+// planar YCbCr interface
+//
+// Returns the Y, Cb and Cr planes of a JPEG as they were decoded, before
+// upsampling and color conversion, so you can do those yourself (e.g. on
+// the GPU). Chroma planes keep their subsampling; the samples are centered
+// between the luma samples they cover (JFIF siting), so bilinear filtering
+// with normalized coordinates upsamples them the way stbi_load does. Values
+// are full range: R = Y + 1.402 (Cr-128), G = Y - 0.344136 (Cb-128) -
+// 0.714136 (Cr-128), B = Y + 1.772 (Cb-128).
+//
+// Grayscale JPEGs return a single plane. Anything else (other formats, and
+// RGB, CMYK or YCCK JPEGs) fails with "not YCbCr", so fall back to
+// stbi_load. All planes live in the returned block; free it with
+// stbi_image_free. Vertical flipping applies to every plane.
+
+typedef struct
+{
+   int num_planes;      // 1 (Y) or 3 (Y, Cb, Cr)
+   int w[3], h[3];      // size of each plane
+   stbi_uc *plane[3];   // w*h bytes each, tightly packed; plane[0] is the returned pointer
+} stbi_planes;
+
+STBIDEF stbi_uc *stbi_load_ycbcr_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, stbi_planes *planes);
+STBIDEF stbi_uc *stbi_load_ycbcr_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, stbi_planes *planes);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ycbcr          (char const *filename, int *x, int *y, stbi_planes *planes);
+STBIDEF stbi_uc *stbi_load_ycbcr_from_file(FILE *f,              int *x, int *y, stbi_planes *planes);
+#endif
+
+#ifndef STBI_NO_GIF
+////////////////////////////////////
+//
+// animated GIF streaming interface
+//
+// stbi_load_gif_from_memory returns all frames of an animation at once,
+// which for long GIFs means a lot of memory and a long wait for the first
+// frame. A gif stream instead composites one frame per call to 'next',
+// keeping only a few frames' worth of state whatever the length.
+//
+// 'open' reads the header and returns the canvas size; *channels_in_file
+// is always 4. 'next' returns the next frame (x*y*channels bytes, with
+// vertical flipping applied if it was on at 'open') and its delay in
+// milliseconds, or NULL once the animation is over or on error (see
+// stbi_failure_reason). The frame belongs to the stream and stays valid
+// until the next call. To loop, close the stream and open it again. The
+// memory and file versions read the data as frames are decoded, so the
+// buffer (or FILE) must stay around until 'close'.
+
+typedef struct stbi__gif_stream stbi_gif_stream;
+
+STBIDEF stbi_gif_stream *stbi_gif_stream_open_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_gif_stream *stbi_gif_stream_open_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_stream *stbi_gif_stream_open_from_file     (FILE *f,                               int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+STBIDEF stbi_uc const   *stbi_gif_stream_next (stbi_gif_stream *gs, int *delay);
+STBIDEF void             stbi_gif_stream_close(stbi_gif_stream *gs);
+#endif
+
 ////////////////////////////////////
 //
 // 16-bits-per-channel interface
@@ -464,6 +772,29 @@ STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_i
 #ifndef STBI_NO_HDR
    STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma);
    STBIDEF void   stbi_hdr_to_ldr_scale(float scale);
+
+   // Radiance .hdr files decoded straight into one of the formats below,
+   // without a float image in between; always RGB:
+   //    STBI_hdr_float   3 floats, 12 bytes per pixel (same as stbi_loadf)
+   //    STBI_hdr_half    3 half floats, 6 bytes (GL_RGB16F / GL_HALF_FLOAT)
+   //    STBI_hdr_rgb9e5  one 32-bit shared-exponent value, 4 bytes
+   //                     (GL_RGB9_E5 / GL_UNSIGNED_INT_5_9_9_9_REV)
+   // Values too large for the format are clamped to its largest (65504 for
+   // halves, 65408 for rgb9e5). Other file types fail with "not HDR".
+   enum
+   {
+      STBI_hdr_float,
+      STBI_hdr_half,
+      STBI_hdr_rgb9e5
+   };
+
+   STBIDEF void  *stbi_load_hdr_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int format);
+   STBIDEF void  *stbi_load_hdr_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int format);
+
+   #ifndef STBI_NO_STDIO
+   STBIDEF void  *stbi_load_hdr          (char const *filename, int *x, int *y, int format);
+   STBIDEF void  *stbi_load_hdr_from_file(FILE *f, int *x, int *y, int format);
+   #endif
 #endif // STBI_NO_HDR
 
 #ifndef STBI_NO_LINEAR
@@ -514,12 +845,52 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// stbi_load_16* return unsigned normalized samples in native byte order
+// (GL_UNSIGNED_SHORT). set this flag to get IEEE half floats in 0..1 instead
+// (GL_HALF_FLOAT); 16-bit PNGs are converted as they are decoded
+STBIDEF void stbi_set_half_float_on_load(int flag_true_if_should_return_half);
+
 // as above, but only applies to images loaded on the thread that calls the function
 // this function is only available if your compiler supports thread-local variables;
-// calling it will fail to link if your compiler doesn't
+// calling it will fail to link if your compiler doesn't (the _ex functions take
+// these settings per call on any compiler, see stbi_load_options)
 STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply);
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
+STBIDEF void stbi_set_half_float_on_load_thread(int flag_true_if_should_return_half);
+
+// maximum number of threads a single load may use if compiled with STBI_THREADS;
+// 0 means one per CPU (the default), 1 means don't use threads
+STBIDEF void stbi_set_thread_count(int count);
+
+// by default all memory comes from STBI_MALLOC/STBI_REALLOC/STBI_FREE. this
+// routes everything except files read by name and the large temporaries of
+// JPEG and PNG loads (which are cached, see below) through your functions
+// instead: the images a load returns, the buffers of a stbi_gif_stream, and
+// the smaller temporaries. NULL goes back to the macros, and so does a set
+// without malloc_fn or free_fn. realloc_fn may be NULL: blocks then grow by
+// malloc_fn, a copy and free_fn. set it before loading, and free images with
+// stbi_image_free while the same allocator is installed.
+typedef struct
+{
+   void *(*malloc_fn) (void *user, size_t size);
+   void *(*realloc_fn)(void *user, void *p, size_t old_size, size_t new_size);
+   void  (*free_fn)   (void *user, void *p);
+   void *user;
+} stbi_allocator;
+
+STBIDEF void stbi_set_allocator(stbi_allocator const *allocator);
+
+// temporary buffers (JPEG planes and coefficients, PNG compressed and inflated
+// data, files read by name) always come from STBI_MALLOC, and are kept in a
+// small cache when a load is done, so the next load reuses them instead of
+// allocating and page-faulting them again. loads through a stbi_decoder use
+// the decoder's cache; with STBI_THREADS, other loads use a cache of the
+// calling thread, which is freed when the thread exits. each cache keeps at
+// most STBI_SCRATCH_LIMIT bytes (default 64MB, 0 disables caching). this
+// frees the calling thread's cache now, e.g. after loading a level's worth of
+// textures on a thread that stays around.
+STBIDEF void stbi_release_scratch(void);
 
 // ZLIB client - used by PNG, available for other purposes
 
@@ -528,6 +899,11 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
 STBIDEF char *stbi_zlib_decode_malloc(const char *buffer, int len, int *outlen);
 STBIDEF int   stbi_zlib_decode_buffer(char *obuffer, int olen, const char *ibuffer, int ilen);
 
+// decodes into a caller-supplied buffer that is never grown; a stream that
+// produces more than olen bytes is still decoded (and checked) to the end,
+// but only the first olen bytes are stored. returns the number stored, or -1
+STBIDEF int   stbi_zlib_decode_into(char *obuffer, int olen, const char *ibuffer, int ilen, int parse_header);
+
 STBIDEF char *stbi_zlib_decode_noheader_malloc(const char *buffer, int len, int *outlen);
 STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen);
 
@@ -595,6 +971,38 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <stdio.h>
 #endif
 
+// the filename entry points map regular files and decode them from memory;
+// elsewhere they go through stdio
+#if defined(STBI_NO_STDIO) || !(defined(_WIN32) || defined(__unix__) || defined(__APPLE__))
+#ifndef STBI_NO_MMAP
+#define STBI_NO_MMAP
+#endif
+#endif
+
+#ifndef STBI_NO_MMAP
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+// keep windows.h from defining min and max over the user's std::min/std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#define STBI__NOMINMAX
+#endif
+#include <windows.h>
+#ifdef STBI__NOMINMAX
+#undef NOMINMAX
+#undef STBI__NOMINMAX
+#endif
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -640,12 +1048,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -657,16 +1067,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-   #define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-   #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (-(y) & 31)))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -747,18 +1147,15 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
    return ((info3 >> 26) & 1) != 0;
 }
-#endif
 
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -766,9 +1163,76 @@ static int stbi__sse2_available(void)
    // instructions at will, and so are we.
    return 1;
 }
+
+#endif
+#endif
+
+// AVX2 is only used by kernels that work on several blocks at once, and by
+// PNG palette lookups (gathers and byte shuffles). Unlike SSE2 it is never
+// assumed: it is checked at run-time, and on GCC/Clang those kernels are
+// compiled with a per-function target attribute, so the rest of the file
+// does not need -mavx2. Define STBI_NO_AVX2 to leave it out.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG))
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBI_AVX2
+#define STBI__AVX2_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define STBI_AVX2
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+static int stbi__avx2_available(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info,0);
+   if (info[0] < 7) return 0;
+   __cpuid(info,1);
+   // AVX and OSXSAVE, and the OS has to preserve the YMM registers
+   if ((info[2] & 0x18000000) != 0x18000000) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info,7,0);
+   return ((info[1] >> 5) & 1) != 0;
+#else
+#ifndef __clang__
+   __builtin_cpu_init();
+#endif
+   return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
 #endif
 
+// SSSE3 is only used for the byte shuffles that convert between channel
+// counts. Like AVX2 it is checked at run-time and compiled per function.
+// Define STBI_NO_SSSE3 to leave it out.
+#if defined(STBI_SSE2) && !defined(STBI_NO_SSSE3) && !(defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM))
+#if defined(_MSC_VER) && _MSC_VER >= 1500
+#define STBI_SSSE3
+#define STBI__SSSE3_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define STBI_SSSE3
+#define STBI__SSSE3_TARGET __attribute__((target("ssse3")))
+#endif
+#endif
+
+#ifdef STBI_SSSE3
+#include <tmmintrin.h>
+static int stbi__ssse3_available(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info,1);
+   return ((info[2] >> 9) & 1) != 0;
+#else
+#ifndef __clang__
+   __builtin_cpu_init();
 #endif
+   return __builtin_cpu_supports("ssse3") != 0;
+#endif
+}
 #endif
 
 // ARM NEON
@@ -795,117 +1259,556 @@ static int stbi__sse2_available(void)
 
 ///////////////////////////////////////////////
 //
-//  stbi__context struct and start_xxx functions
-
-// stbi__context structure is our basic context used by all images, so it
-// contains all the IO context, plus some basic image information
-typedef struct
-{
-   stbi__uint32 img_x, img_y;
-   int img_n, img_out_n;
-
-   stbi_io_callbacks io;
-   void *io_user_data;
+//  worker threads
+//
+//  stbi__parallel_for runs func(user, i) for i in [0, count) on up to
+//  `threads` threads, including the calling one, and returns when all
+//  calls have finished. Without STBI_THREADS it is a plain loop.
+//  with STBI_THREADS, stbi__thread_start/join also run a job on a single
+//  extra thread, for pipelines that need both sides running at once.
+//  inside stbi_load_batch (b non-NULL) no threads are started: the job is
+//  offered to the batch's threads that have run out of images instead.
+
+typedef void stbi__task_func(void *user, int index);
+typedef struct stbi__batch stbi__batch;
+
+#ifndef STBI_MAX_THREADS
+#define STBI_MAX_THREADS 32
+#endif
 
-   int read_from_callbacks;
-   int buflen;
-   stbi_uc buffer_start[128];
-   int callback_already_read;
+static int stbi__thread_count_set = 0;
 
-   stbi_uc *img_buffer, *img_buffer_end;
-   stbi_uc *img_buffer_original, *img_buffer_original_end;
-} stbi__context;
+STBIDEF void stbi_set_thread_count(int count)
+{
+   stbi__thread_count_set = count < 0 ? 0 : count;
+}
 
+#ifdef STBI_THREADS
 
-static void stbi__refill_buffer(stbi__context *s);
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#define STBI__NOMINMAX
+#endif
+#include <windows.h>
+#ifdef STBI__NOMINMAX
+#undef NOMINMAX
+#undef STBI__NOMINMAX
+#endif
+typedef HANDLE stbi__thread;
+// SRW locks are a single pointer, need no cleanup, and are cheaper to take
+// than a critical section when held as briefly as these are
+typedef SRWLOCK stbi__mutex;
+#define stbi__mutex_init(m)    InitializeSRWLock(m)
+#define stbi__mutex_destroy(m) ((void) 0)
+#define stbi__mutex_lock(m)    AcquireSRWLockExclusive(m)
+#define stbi__mutex_unlock(m)  ReleaseSRWLockExclusive(m)
+typedef CONDITION_VARIABLE stbi__cond;
+#define stbi__cond_init(c)       InitializeConditionVariable(c)
+#define stbi__cond_destroy(c)    ((void) 0)
+#define stbi__cond_wait(c, m)    SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define stbi__cond_broadcast(c)  WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t stbi__thread;
+typedef pthread_mutex_t stbi__mutex;
+#define stbi__mutex_init(m)    pthread_mutex_init(m, NULL)
+#define stbi__mutex_destroy(m) pthread_mutex_destroy(m)
+#define stbi__mutex_lock(m)    pthread_mutex_lock(m)
+#define stbi__mutex_unlock(m)  pthread_mutex_unlock(m)
+typedef pthread_cond_t stbi__cond;
+#define stbi__cond_init(c)       pthread_cond_init(c, NULL)
+#define stbi__cond_destroy(c)    pthread_cond_destroy(c)
+#define stbi__cond_wait(c, m)    pthread_cond_wait(c, m)
+#define stbi__cond_broadcast(c)  pthread_cond_broadcast(c)
+#endif
 
-// initialize a memory-decode context
-static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+typedef struct
 {
-   s->io.read = NULL;
-   s->read_from_callbacks = 0;
-   s->callback_already_read = 0;
-   s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
-   s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
-}
+   stbi__task_func *func;
+   void *user;
+   int count, next;
+   stbi__mutex lock;
+   int helpers;   // stbi_load_batch threads working on it besides its owner
+} stbi__parallel_job;
 
-// initialize a callback-based context
-static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+static int stbi__thread_count(void)
 {
-   s->io = *c;
-   s->io_user_data = user;
-   s->buflen = sizeof(s->buffer_start);
-   s->read_from_callbacks = 1;
-   s->callback_already_read = 0;
-   s->img_buffer = s->img_buffer_original = s->buffer_start;
-   stbi__refill_buffer(s);
-   s->img_buffer_original_end = s->img_buffer_end;
+   int n = stbi__thread_count_set;
+   if (n == 0) {
+#if defined(_WIN32) && defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0601
+      // all processor groups; GetSystemInfo only counts the caller's
+      n = (int) GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#elif defined(_WIN32)
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      n = (int) info.dwNumberOfProcessors;
+#else
+      n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+   }
+   if (n < 1) n = 1;
+   if (n > STBI_MAX_THREADS) n = STBI_MAX_THREADS;
+   return n;
 }
 
-#ifndef STBI_NO_STDIO
-
-static int stbi__stdio_read(void *user, char *data, int size)
+static void stbi__parallel_work(stbi__parallel_job *job)
 {
-   return (int) fread(data,1,size,(FILE*) user);
+   for (;;) {
+      int i;
+      stbi__mutex_lock(&job->lock);
+      i = job->next++;
+      stbi__mutex_unlock(&job->lock);
+      if (i >= job->count) break;
+      job->func(job->user, i);
+   }
 }
 
-static void stbi__stdio_skip(void *user, int n)
+#ifdef _WIN32
+static DWORD WINAPI stbi__thread_main(LPVOID job)
 {
-   int ch;
-   fseek((FILE*) user, n, SEEK_CUR);
-   ch = fgetc((FILE*) user);  /* have to read a byte to reset feof()'s flag */
-   if (ch != EOF) {
-      ungetc(ch, (FILE *) user);  /* push byte back onto stream if valid. */
-   }
+   stbi__parallel_work((stbi__parallel_job *) job);
+   return 0;
 }
-
-static int stbi__stdio_eof(void *user)
+#else
+static void *stbi__thread_main(void *job)
 {
-   return feof((FILE*) user) || ferror((FILE *) user);
+   stbi__parallel_work((stbi__parallel_job *) job);
+   return NULL;
 }
+#endif
 
-static stbi_io_callbacks stbi__stdio_callbacks =
+// start a thread that works on job; returns 0 if it couldn't be created
+static int stbi__thread_start(stbi__thread *t, stbi__parallel_job *job)
 {
-   stbi__stdio_read,
-   stbi__stdio_skip,
-   stbi__stdio_eof,
-};
+#ifdef _WIN32
+   *t = CreateThread(NULL, 0, stbi__thread_main, job, 0, NULL);
+   return *t != NULL;
+#else
+   return pthread_create(t, NULL, stbi__thread_main, job) == 0;
+#endif
+}
 
-static void stbi__start_file(stbi__context *s, FILE *f)
+static void stbi__thread_join(stbi__thread t)
 {
-   stbi__start_callbacks(s, &stbi__stdio_callbacks, (void *) f);
+#ifdef _WIN32
+   WaitForSingleObject(t, INFINITE);
+   CloseHandle(t);
+#else
+   pthread_join(t, NULL);
+#endif
 }
 
-//static void stop_file(stbi__context *s) { }
+#ifndef STBI_NO_JPEG
+static void stbi__batch_parallel(stbi__batch *b, stbi__parallel_job *job);
+
+static void stbi__parallel_for(stbi__batch *b, int threads, int count, stbi__task_func *func, void *user)
+{
+   stbi__thread thread[STBI_MAX_THREADS];
+   stbi__parallel_job job;
+   int i, started=0, n = threads;
+   if (n > STBI_MAX_THREADS) n = STBI_MAX_THREADS;
+   if (n > count) n = count;
+   if (n <= 1) {
+      for (i=0; i < count; ++i)
+         func(user, i);
+      return;
+   }
+   job.func = func;
+   job.user = user;
+   job.count = count;
+   job.next = 0;
+   job.helpers = 0;
+   stbi__mutex_init(&job.lock);
+   if (b) {
+      stbi__batch_parallel(b, &job);
+   } else {
+      // if a thread can't be created, the ones we have just pick up its share
+      for (i=0; i < n-1; ++i) {
+         if (!stbi__thread_start(&thread[started], &job)) break;
+         ++started;
+      }
+      stbi__parallel_work(&job);
+      for (i=0; i < started; ++i)
+         stbi__thread_join(thread[i]);
+   }
+   stbi__mutex_destroy(&job.lock);
+}
+#endif
 
-#endif // !STBI_NO_STDIO
+#elif !defined(STBI_NO_JPEG) // !STBI_THREADS
 
-static void stbi__rewind(stbi__context *s)
+static int stbi__thread_count(void)
 {
-   // conceptually rewind SHOULD rewind to the beginning of the stream,
-   // but we just rewind to the beginning of the initial buffer, because
-   // we only use it after doing 'test', which only ever looks at at most 92 bytes
-   s->img_buffer = s->img_buffer_original;
-   s->img_buffer_end = s->img_buffer_original_end;
+   return 1;
 }
 
-enum
+static void stbi__parallel_for(stbi__batch *b, int threads, int count, stbi__task_func *func, void *user)
 {
-   STBI_ORDER_RGB,
-   STBI_ORDER_BGR
-};
-
+   int i;
+   STBI_NOTUSED(b);
+   STBI_NOTUSED(threads);
+   for (i=0; i < count; ++i)
+      func(user, i);
+}
+
+#endif // STBI_THREADS
+
+///////////////////////////////////////////////
+//
+//  stbi_load_batch state
+//
+//  every thread owns a run of consecutive items and takes them from the
+//  front; a thread whose run is empty steals the back half of the longest
+//  other run. once there's nothing left to steal, threads wait on cond, and
+//  help with the parallel jobs (see stbi__parallel_for) that the threads
+//  still decoding have listed in help
+
+struct stbi__batch
+{
+   stbi_batch_item *items;
+   int req_comp;
+   stbi_load_options opt;   // the caller's settings, used on every thread
+#ifdef STBI_THREADS
+   int nthreads;
+   struct
+   {
+      int lo, hi;           // items lo..hi-1 are left in this run
+      stbi__mutex lock;
+   } run[STBI_MAX_THREADS];
+   stbi__mutex lock;        // protects the rest
+   stbi__cond cond;
+   int busy, idle;          // threads looking for or doing work / waiting
+   int nhelp;
+   stbi__parallel_job *help[STBI_MAX_THREADS];
+#endif
+};
+
+///////////////////////////////////////////////
+//
+//  stbi__context struct and start_xxx functions
+
+// destination of the rows for stbi_load_rows*
+typedef struct
+{
+   stbi_row_callbacks cb;
+   void *user;
+   int x, y, comp;   // image size and channels in file, set by stbi__stream_begin
+   int row_bytes;    // output row size, also set by stbi__stream_begin
+   int flip;         // vertical flipping is on: row y goes out as row y-1 - y
+   int done;         // the decoder has handed out all rows itself
+   // stbi_load_into: the rows go to dest, pitch bytes apart, instead of to
+   // cb.rows. decoders that write rows there themselves (see
+   // stbi__stream_direct) set direct, and overrun if they write a byte past
+   // the end of a row
+   stbi_uc *dest;
+   int dest_size, pitch;
+   int direct, overrun;
+   // only rows y0..y1-1 and columns x0..x1-1 are wanted (x1 == 0: all of
+   // them until stbi__stream_begin fills in the size). decoders may skip
+   // work outside of that, and hand out rows that start at column row_x
+   int x0, y0, x1, y1;
+   int row_x;
+} stbi__stream;
+
+// scratch buffers a decoder keeps for its next load, see stbi__scratch_malloc
+#ifndef STBI_SCRATCH_LIMIT
+#define STBI_SCRATCH_LIMIT  (64 << 20)
+#endif
+
+#define STBI__SCRATCH_SLOTS  8
+
+typedef struct
+{
+   char *slot[STBI__SCRATCH_SLOTS];
+   size_t bytes;
+} stbi__scratch_cache;
+
+// what stbi_decoder keeps between images; jpeg and zlib are allocated on first use
+struct stbi__decoder
+{
+   void *jpeg;   // stbi__jpeg, with the Huffman tables of the last JPEG
+   void *zlib;   // stbi__zcache, the Huffman tables of the last PNG
+   stbi__scratch_cache scratch;
+};
+
+#if STBI_SCRATCH_LIMIT > 0
+#define STBI__SCRATCH_CACHE
+#endif
+
+static void stbi__scratch_release(stbi__scratch_cache *c)
+{
+   int i;
+   for (i=0; i < STBI__SCRATCH_SLOTS; ++i) {
+      if (c->slot[i]) STBI_FREE(c->slot[i]);
+      c->slot[i] = NULL;
+   }
+   c->bytes = 0;
+}
+
+// loads that don't go through a stbi_decoder use a cache of the calling
+// thread, made by its first load. it needs the thread API to be freed when
+// the thread exits (a thread_local variable has no destructor in C), so
+// without STBI_THREADS those loads use plain malloc/free.
+#if defined(STBI__SCRATCH_CACHE) && defined(STBI_THREADS)
+#define STBI__THREAD_SCRATCH
+
+static void stbi__thread_scratch_free(void *c)
+{
+   if (c) {
+      stbi__scratch_release((stbi__scratch_cache *) c);
+      STBI_FREE(c);
+   }
+}
+
+#ifdef _WIN32
+// fiber-local storage, because TlsAlloc has no callback for thread exit
+static INIT_ONCE stbi__thread_scratch_once = INIT_ONCE_STATIC_INIT;
+static DWORD stbi__thread_scratch_key = FLS_OUT_OF_INDEXES;
+
+static void WINAPI stbi__thread_scratch_exit(void *c)
+{
+   stbi__thread_scratch_free(c);
+}
+
+static BOOL CALLBACK stbi__thread_scratch_init(PINIT_ONCE once, void *param, void **context)
+{
+   STBI_NOTUSED(once);
+   STBI_NOTUSED(param);
+   STBI_NOTUSED(context);
+   stbi__thread_scratch_key = FlsAlloc(stbi__thread_scratch_exit);
+   return TRUE;
+}
+
+static stbi__scratch_cache *stbi__thread_scratch_get(void)
+{
+   InitOnceExecuteOnce(&stbi__thread_scratch_once, stbi__thread_scratch_init, NULL, NULL);
+   if (stbi__thread_scratch_key == FLS_OUT_OF_INDEXES) return NULL;
+   return (stbi__scratch_cache *) FlsGetValue(stbi__thread_scratch_key);
+}
+
+static int stbi__thread_scratch_set(stbi__scratch_cache *c)
+{
+   return FlsSetValue(stbi__thread_scratch_key, c) != 0;
+}
+#else
+static pthread_once_t stbi__thread_scratch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stbi__thread_scratch_key;
+static int stbi__thread_scratch_ok;
+
+static void stbi__thread_scratch_init(void)
+{
+   stbi__thread_scratch_ok = pthread_key_create(&stbi__thread_scratch_key, stbi__thread_scratch_free) == 0;
+}
+
+static stbi__scratch_cache *stbi__thread_scratch_get(void)
+{
+   pthread_once(&stbi__thread_scratch_once, stbi__thread_scratch_init);
+   if (!stbi__thread_scratch_ok) return NULL;
+   return (stbi__scratch_cache *) pthread_getspecific(stbi__thread_scratch_key);
+}
+
+static int stbi__thread_scratch_set(stbi__scratch_cache *c)
+{
+   return pthread_setspecific(stbi__thread_scratch_key, c) == 0;
+}
+#endif
+#endif // STBI__THREAD_SCRATCH
+
+// the calling thread's cache, NULL if there is none (and create is 0, or it
+// can't be made)
+static stbi__scratch_cache *stbi__thread_scratch(int create)
+{
+#ifdef STBI__THREAD_SCRATCH
+   stbi__scratch_cache *c = stbi__thread_scratch_get();
+   if (c || !create) return c;
+   c = (stbi__scratch_cache *) STBI_MALLOC(sizeof(*c));
+   if (!c) return NULL;
+   memset(c, 0, sizeof(*c));
+   if (!stbi__thread_scratch_set(c)) {
+      STBI_FREE(c);
+      return NULL;
+   }
+   return c;
+#else
+   STBI_NOTUSED(create);
+   return NULL;
+#endif
+}
+
+STBIDEF void stbi_release_scratch(void)
+{
+   stbi__scratch_cache *c = stbi__thread_scratch(0);
+   if (c) stbi__scratch_release(c);
+}
+
+// the cache a load with this decoder (or none) uses
+static stbi__scratch_cache *stbi__scratch_for(stbi_decoder *dec)
+{
+   return dec ? &dec->scratch : stbi__thread_scratch(1);
+}
+
+// stbi__context structure is our basic context used by all images, so it
+// contains all the IO context, plus some basic image information
+typedef struct
+{
+   stbi__uint32 img_x, img_y;
+   int img_n, img_out_n;
+
+   stbi_io_callbacks io;
+   void *io_user_data;
+
+   int read_from_callbacks;
+   int buflen;
+   stbi_uc buffer_start[128];
+   int callback_already_read;
+
+   stbi_uc *img_buffer, *img_buffer_end;
+   stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   int jpeg_scale; // 1, 2, 4 or 8: decode JPEGs at 1/jpeg_scale size
+   stbi__stream *stream; // set for stbi_load_rows*; decoders that can, stream into it
+   int half; // stbi_load_16* wants half floats; decoders that can, write them directly
+   int flip; // vertical flipping is on; decoders that can, write the rows bottom-up
+   stbi_decoder *dec; // set for stbi_decoder_*; decoders that can, keep their tables in it
+   stbi__scratch_cache *scratch; // where the load's scratch buffers go back to, see stbi__scratch_malloc
+   stbi_load_options opt; // settings of this load; decoders read these, never the globals
+   stbi__batch *batch; // set for stbi_load_batch; parallel work goes to its threads
+} stbi__context;
+
+
+static void stbi__refill_buffer(stbi__context *s);
+
+// initialize a memory-decode context
+static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+{
+   s->jpeg_scale = 1;
+   s->stream = NULL;
+   s->half = 0;
+   s->flip = 0;
+   s->dec = NULL;
+   s->scratch = stbi__thread_scratch(1);
+   stbi_load_options_init(&s->opt);
+   s->batch = NULL;
+   s->io.read = NULL;
+   s->read_from_callbacks = 0;
+   s->callback_already_read = 0;
+   s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
+   s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+}
+
+// initialize a callback-based context
+static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+{
+   s->jpeg_scale = 1;
+   s->stream = NULL;
+   s->half = 0;
+   s->flip = 0;
+   s->dec = NULL;
+   s->scratch = stbi__thread_scratch(1);
+   stbi_load_options_init(&s->opt);
+   s->batch = NULL;
+   s->io = *c;
+   s->io_user_data = user;
+   s->buflen = sizeof(s->buffer_start);
+   s->read_from_callbacks = 1;
+   s->callback_already_read = 0;
+   s->img_buffer = s->img_buffer_original = s->buffer_start;
+   stbi__refill_buffer(s);
+   s->img_buffer_original_end = s->img_buffer_end;
+}
+
+#if !defined(STBI_NO_JPEG) || (!defined(STBI_NO_PNG) && defined(STBI_THREADS))
+// how many threads the parallel parts of a load should plan for: inside
+// stbi_load_batch, only this one and those that have run out of images
+static int stbi__load_threads(stbi__context *s)
+{
+#ifdef STBI_THREADS
+   if (s->batch) {
+      int n;
+      stbi__mutex_lock(&s->batch->lock);
+      n = s->batch->idle + 1;
+      stbi__mutex_unlock(&s->batch->lock);
+      return n;
+   }
+#else
+   STBI_NOTUSED(s);
+#endif
+   return stbi__thread_count();
+}
+#endif
+
+#ifndef STBI_NO_STDIO
+
+static int stbi__stdio_read(void *user, char *data, int size)
+{
+   return (int) fread(data,1,size,(FILE*) user);
+}
+
+static void stbi__stdio_skip(void *user, int n)
+{
+   int ch;
+   fseek((FILE*) user, n, SEEK_CUR);
+   ch = fgetc((FILE*) user);  /* have to read a byte to reset feof()'s flag */
+   if (ch != EOF) {
+      ungetc(ch, (FILE *) user);  /* push byte back onto stream if valid. */
+   }
+}
+
+static int stbi__stdio_eof(void *user)
+{
+   return feof((FILE*) user) || ferror((FILE *) user);
+}
+
+static stbi_io_callbacks stbi__stdio_callbacks =
+{
+   stbi__stdio_read,
+   stbi__stdio_skip,
+   stbi__stdio_eof,
+};
+
+static void stbi__start_file(stbi__context *s, FILE *f)
+{
+   stbi__start_callbacks(s, &stbi__stdio_callbacks, (void *) f);
+}
+
+//static void stop_file(stbi__context *s) { }
+
+#endif // !STBI_NO_STDIO
+
+static void stbi__rewind(stbi__context *s)
+{
+   // conceptually rewind SHOULD rewind to the beginning of the stream,
+   // but we just rewind to the beginning of the initial buffer, because
+   // we only use it after doing 'test', which only ever looks at at most 92 bytes
+   s->img_buffer = s->img_buffer_original;
+   s->img_buffer_end = s->img_buffer_original_end;
+}
+
+enum
+{
+   STBI_ORDER_RGB,
+   STBI_ORDER_BGR
+};
+
 typedef struct
 {
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int half; // 16-bit samples are already half floats
+   int flipped; // the rows are already bottom-up
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
 static int      stbi__jpeg_test(stbi__context *s);
 static void    *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
 static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
+static stbi_uc *stbi__jpeg_load_ycbcr(stbi__context *s, int *x, int *y, stbi_planes *planes);
 #endif
 
 #ifndef STBI_NO_PNG
@@ -979,10 +1882,133 @@ static int stbi__err(const char *str)
 }
 #endif
 
+static stbi_allocator stbi__allocator; // all zero: use STBI_MALLOC and friends
+
+STBIDEF void stbi_set_allocator(stbi_allocator const *allocator)
+{
+   // blocks from malloc_fn must go back to free_fn, so it takes both
+   if (allocator && allocator->malloc_fn && allocator->free_fn)
+      stbi__allocator = *allocator;
+   else
+      memset(&stbi__allocator, 0, sizeof(stbi__allocator));
+}
+
 static void *stbi__malloc(size_t size)
 {
-    return STBI_MALLOC(size);
+   if (stbi__allocator.malloc_fn) return stbi__allocator.malloc_fn(stbi__allocator.user, size);
+   return STBI_MALLOC(size);
+}
+
+#if !(defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)) || !defined(STBI_NO_ZLIB)
+static void *stbi__realloc_sized(void *p, size_t oldsz, size_t newsz)
+{
+   void *q;
+   if (stbi__allocator.realloc_fn) return stbi__allocator.realloc_fn(stbi__allocator.user, p, oldsz, newsz);
+   if (!stbi__allocator.malloc_fn) return STBI_REALLOC_SIZED(p, oldsz, newsz);
+   // hooks without realloc_fn: a block that is big enough stays, others move
+   if (p && newsz <= oldsz) return p;
+   q = stbi__allocator.malloc_fn(stbi__allocator.user, newsz);
+   if (q && p) {
+      memcpy(q, p, oldsz);
+      stbi__allocator.free_fn(stbi__allocator.user, p);
+   }
+   return q;
+}
+#endif
+
+static void stbi__free(void *p)
+{
+   if (!stbi__allocator.malloc_fn)
+      STBI_FREE(p);
+   else if (p)
+      stbi__allocator.free_fn(stbi__allocator.user, p);
+}
+
+// Scratch buffers are the temporaries a load frees before it returns. They
+// come from STBI_MALLOC with a 16-byte header holding their capacity (which
+// keeps malloc's alignment), and instead of being freed they go into the
+// load's cache (s->scratch: the stbi_decoder's, or else the thread's), to be
+// handed out again to the next request that fits. With no cache they are
+// plain malloc/free. Only the thread that runs the load allocates and frees
+// them, never the workers of stbi__parallel_for.
+#define STBI__SCRATCH_HEADER 16
+
+#define stbi__scratch_cap(b)  (*(size_t *) (b))
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_MMAP)
+static void *stbi__scratch_malloc(stbi__scratch_cache *c, size_t size)
+{
+   char *b;
+#ifdef STBI__SCRATCH_CACHE
+   int i, best = -1;
+   // the smallest cached block that fits
+   for (i=0; c && i < STBI__SCRATCH_SLOTS; ++i) {
+      b = c->slot[i];
+      if (b && stbi__scratch_cap(b) >= size && (best < 0 || stbi__scratch_cap(b) < stbi__scratch_cap(c->slot[best])))
+         best = i;
+   }
+   if (best >= 0) {
+      b = c->slot[best];
+      c->slot[best] = NULL;
+      c->bytes -= stbi__scratch_cap(b);
+      return b + STBI__SCRATCH_HEADER;
+   }
+#else
+   STBI_NOTUSED(c);
+#endif
+   if (size > (size_t) -1 - STBI__SCRATCH_HEADER) return NULL;
+   b = (char *) STBI_MALLOC(size + STBI__SCRATCH_HEADER);
+   if (!b) return NULL;
+   stbi__scratch_cap(b) = size;
+   return b + STBI__SCRATCH_HEADER;
+}
+
+static void stbi__scratch_free(stbi__scratch_cache *c, void *p)
+{
+   char *b;
+#ifdef STBI__SCRATCH_CACHE
+   int i, slot = -1;
+   size_t drop = 0;
+#else
+   STBI_NOTUSED(c);
+#endif
+   if (!p) return;
+   b = (char *) p - STBI__SCRATCH_HEADER;
+#ifdef STBI__SCRATCH_CACHE
+   // take an empty slot, or else push out the smallest block smaller than this one
+   for (i=0; c && i < STBI__SCRATCH_SLOTS; ++i) {
+      char *d = c->slot[i];
+      if (!d) { slot = i; drop = 0; break; }
+      if (stbi__scratch_cap(d) < stbi__scratch_cap(b) && (slot < 0 || stbi__scratch_cap(d) < drop)) {
+         slot = i;
+         drop = stbi__scratch_cap(d);
+      }
+   }
+   if (slot >= 0 && c->bytes - drop + stbi__scratch_cap(b) <= (size_t) STBI_SCRATCH_LIMIT) {
+      if (c->slot[slot]) STBI_FREE(c->slot[slot]);
+      c->slot[slot] = b;
+      c->bytes += stbi__scratch_cap(b) - drop;
+      return;
+   }
+#endif
+   STBI_FREE(b);
+}
+#endif
+
+#ifndef STBI_NO_PNG
+// like realloc, except that the old block is only given up on success
+static void *stbi__scratch_realloc(stbi__scratch_cache *c, void *p, size_t oldsz, size_t newsz)
+{
+   void *q;
+   if (p && stbi__scratch_cap((char *) p - STBI__SCRATCH_HEADER) >= newsz) return p;
+   q = stbi__scratch_malloc(c, newsz);
+   if (q && p) {
+      memcpy(q, p, oldsz);
+      stbi__scratch_free(c, p);
+   }
+   return q;
 }
+#endif
 
 // stb_image uses ints pervasively, including for offset calculations.
 // therefore the largest decoded image size we can support with the
@@ -1040,7 +2066,7 @@ static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
 // mallocs with size overflow checking
 static void *stbi__malloc_mad2(int a, int b, int add)
 {
@@ -1063,6 +2089,22 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 }
 #endif
 
+#if !defined(STBI_NO_JPEG) || (!defined(STBI_NO_PNG) && defined(STBI_THREADS))
+static void *stbi__scratch_mad2(stbi__scratch_cache *c, int a, int b, int add)
+{
+   if (!stbi__mad2sizes_valid(a, b, add)) return NULL;
+   return stbi__scratch_malloc(c, a*b + add);
+}
+#endif
+
+#ifndef STBI_NO_JPEG
+static void *stbi__scratch_mad3(stbi__scratch_cache *sc, int a, int b, int c, int add)
+{
+   if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
+   return stbi__scratch_malloc(sc, a*b*c + add);
+}
+#endif
+
 // stbi__err - error
 // stbi__errpf - error returning pointer to float
 // stbi__errpuc - error returning pointer to unsigned char
@@ -1080,15 +2122,15 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
-   STBI_FREE(retval_from_stbi_load);
+   stbi__free(retval_from_stbi_load);
 }
 
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
+static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp, float gamma, float scale);
 #endif
 
 #ifndef STBI_NO_HDR
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
+static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp, float gamma, float scale);
 #endif
 
 static int stbi__vertically_flip_on_load_global = 0;
@@ -1114,30 +2156,119 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
-static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+static int stbi__half_float_on_load_global = 0;
+
+STBIDEF void stbi_set_half_float_on_load(int flag_true_if_should_return_half)
 {
-   memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
-   ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
-   ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
-   ri->num_channels = 0;
+   stbi__half_float_on_load_global = flag_true_if_should_return_half;
+}
 
-   // test the formats with a very explicit header first (at least a FOURCC
-   // or distinctive magic number first)
-   #ifndef STBI_NO_PNG
-   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
-   #endif
-   #ifndef STBI_NO_BMP
-   if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
-   #endif
-   #ifndef STBI_NO_GIF
-   if (stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
-   #endif
-   #ifndef STBI_NO_PSD
-   if (stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
-   #else
-   STBI_NOTUSED(bpc);
-   #endif
-   #ifndef STBI_NO_PIC
+#ifndef STBI_THREAD_LOCAL
+#define stbi__half_float_on_load  stbi__half_float_on_load_global
+#else
+static STBI_THREAD_LOCAL int stbi__half_float_on_load_local, stbi__half_float_on_load_set;
+
+STBIDEF void stbi_set_half_float_on_load_thread(int flag_true_if_should_return_half)
+{
+   stbi__half_float_on_load_local = flag_true_if_should_return_half;
+   stbi__half_float_on_load_set = 1;
+}
+
+#define stbi__half_float_on_load  (stbi__half_float_on_load_set       \
+                                    ? stbi__half_float_on_load_local  \
+                                    : stbi__half_float_on_load_global)
+#endif // STBI_THREAD_LOCAL
+
+static int stbi__unpremultiply_on_load_global = 0;
+static int stbi__de_iphone_flag_global = 0;
+
+STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
+{
+   stbi__unpremultiply_on_load_global = flag_true_if_should_unpremultiply;
+}
+
+STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
+{
+   stbi__de_iphone_flag_global = flag_true_if_should_convert;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__unpremultiply_on_load  stbi__unpremultiply_on_load_global
+#define stbi__de_iphone_flag  stbi__de_iphone_flag_global
+#else
+static STBI_THREAD_LOCAL int stbi__unpremultiply_on_load_local, stbi__unpremultiply_on_load_set;
+static STBI_THREAD_LOCAL int stbi__de_iphone_flag_local, stbi__de_iphone_flag_set;
+
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply)
+{
+   stbi__unpremultiply_on_load_local = flag_true_if_should_unpremultiply;
+   stbi__unpremultiply_on_load_set = 1;
+}
+
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert)
+{
+   stbi__de_iphone_flag_local = flag_true_if_should_convert;
+   stbi__de_iphone_flag_set = 1;
+}
+
+#define stbi__unpremultiply_on_load  (stbi__unpremultiply_on_load_set           \
+                                       ? stbi__unpremultiply_on_load_local      \
+                                       : stbi__unpremultiply_on_load_global)
+#define stbi__de_iphone_flag  (stbi__de_iphone_flag_set                         \
+                                ? stbi__de_iphone_flag_local                    \
+                                : stbi__de_iphone_flag_global)
+#endif // STBI_THREAD_LOCAL
+
+static float stbi__l2h_gamma=2.2f, stbi__l2h_scale=1.0f;
+
+#ifndef STBI_NO_LINEAR
+STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
+STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
+#endif
+
+static float stbi__h2l_gamma=2.2f, stbi__h2l_scale=1.0f;
+
+STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma = gamma; }
+STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale = scale; }
+
+STBIDEF void stbi_load_options_init(stbi_load_options *opt)
+{
+   opt->flip_vertically = stbi__vertically_flip_on_load;
+   opt->unpremultiply = stbi__unpremultiply_on_load;
+   opt->convert_iphone_png = stbi__de_iphone_flag;
+   opt->half_float = stbi__half_float_on_load;
+   opt->ldr_to_hdr_gamma = stbi__l2h_gamma;
+   opt->ldr_to_hdr_scale = stbi__l2h_scale;
+   opt->hdr_to_ldr_gamma = stbi__h2l_gamma;
+   opt->hdr_to_ldr_scale = stbi__h2l_scale;
+   opt->jpeg_scale = 1;
+   opt->decoder = NULL;
+}
+
+static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+   memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
+   ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
+   ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
+   ri->num_channels = 0;
+
+   // test the formats with a very explicit header first (at least a FOURCC
+   // or distinctive magic number first)
+   #ifndef STBI_NO_PNG
+   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+   #endif
+   #ifndef STBI_NO_BMP
+   if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
+   #endif
+   #ifndef STBI_NO_GIF
+   if (stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
+   #endif
+   #ifndef STBI_NO_PSD
+   if (stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
+   #else
+   STBI_NOTUSED(bpc);
+   #endif
+   #ifndef STBI_NO_PIC
    if (stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
    #endif
 
@@ -1154,7 +2285,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
       float *hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
-      return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp, s->opt.hdr_to_ldr_gamma, s->opt.hdr_to_ldr_scale);
    }
    #endif
 
@@ -1179,7 +2310,7 @@ static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
@@ -1195,10 +2326,80 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
+// f as a half float, rounded to the nearest, ties to even. this is ryg's
+// float_to_half_fast3_rtne, minus the cases our callers never pass in
+// (negative, 65520 and up, inf, nan)
+static stbi__uint16 stbi__float_to_half(float f)
+{
+   stbi__uint32 u;
+   memcpy(&u, &f, 4);
+   if (u < (113u << 23)) {
+      // half denormal or zero: let the float adder do the rounding
+      f += 0.5f;
+      memcpy(&u, &f, 4);
+      return (stbi__uint16) (u - (126u << 23));
+   }
+   u += ((stbi__uint32) (15 - 127) << 23) + 0xfff + ((u >> 13) & 1);
+   return (stbi__uint16) (u >> 13);
+}
+
+// v/65535 as a half float: v*(1/65535.f) rounded to the nearest half, ties
+// to even (2 of the 65536 inputs land a half ulp off from the exact value)
+static stbi__uint16 stbi__unorm16_to_half(stbi__uint32 v)
+{
+   return stbi__float_to_half((float) v * (1.0f / 65535.0f));
+}
+
+#ifdef STBI_SSE2
+// the same for 4 values, giving halves in 32-bit lanes
+static __m128i stbi__float_to_half_sse2(__m128 f)
+{
+   __m128i u = _mm_castps_si128(f);
+   __m128i den = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(f, _mm_set1_ps(0.5f))), _mm_set1_epi32(126 << 23));
+   __m128i odd = _mm_and_si128(_mm_srli_epi32(u, 13), _mm_set1_epi32(1));
+   __m128i nrm = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(u, _mm_set1_epi32(0xfff - ((127 - 15) << 23))), odd), 13);
+   __m128i m = _mm_cmplt_epi32(u, _mm_set1_epi32(113 << 23));
+   return _mm_or_si128(_mm_and_si128(m, den), _mm_andnot_si128(m, nrm));
+}
+
+static __m128i stbi__unorm16_to_half_sse2(__m128i v)
+{
+   return stbi__float_to_half_sse2(_mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.0f / 65535.0f)));
+}
+#endif
+
+// finish n 16-bit samples in place: from big-endian (as PNG stores them) to
+// native order if big_endian, and from unsigned normalized to half floats
+// if half
+static void stbi__unorm16_row(stbi__uint16 *p, stbi__uint32 n, int big_endian, int half)
+{
+   stbi_uc *b = (stbi_uc *) p;
+   stbi__uint32 i = 0;
+   if (!big_endian && !half) return;
+   #ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      __m128i zero = _mm_setzero_si128();
+      for (; i + 8 <= n; i += 8) {
+         __m128i v = _mm_loadu_si128((__m128i *) (p + i));
+         if (big_endian)
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+         if (half)
+            v = _mm_packs_epi32(stbi__unorm16_to_half_sse2(_mm_unpacklo_epi16(v, zero)),
+                                stbi__unorm16_to_half_sse2(_mm_unpackhi_epi16(v, zero)));
+         _mm_storeu_si128((__m128i *) (p + i), v);
+      }
+   }
+   #endif
+   for (; i < n; ++i) {
+      stbi__uint32 v = big_endian ? (stbi__uint32) ((b[i*2] << 8) | b[i*2+1]) : p[i];
+      p[i] = half ? stbi__unorm16_to_half(v) : (stbi__uint16) v;
+   }
+}
+
 static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
 {
    int row;
@@ -1237,10 +2438,36 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 }
 #endif
 
+static int stbi__valid_scale(int scale)
+{
+   return scale == 1 || scale == 2 || scale == 4 || scale == 8;
+}
+
+// loads through a decoder keep their tables and scratch buffers in it
+static void stbi__use_decoder(stbi__context *s, stbi_decoder *dec)
+{
+   s->dec = dec;
+   s->scratch = stbi__scratch_for(dec);
+}
+
+// the _ex functions: replace the settings a context started with
+static int stbi__use_options(stbi__context *s, stbi_load_options const *opt)
+{
+   if (!opt) return 1;
+   if (!stbi__valid_scale(opt->jpeg_scale)) return stbi__err("bad scale", "Scale must be 1, 2, 4 or 8");
+   s->opt = *opt;
+   s->jpeg_scale = opt->jpeg_scale;
+   stbi__use_decoder(s, opt->decoder);
+   return 1;
+}
+
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   void *result;
+
+   s->flip = s->opt.flip_vertically;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
 
    if (result == NULL)
       return NULL;
@@ -1255,7 +2482,7 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1266,7 +2493,11 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   void *result;
+
+   s->half = s->opt.half_float;
+   s->flip = s->opt.flip_vertically;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
 
    if (result == NULL)
       return NULL;
@@ -1277,12 +2508,16 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    if (ri.bits_per_channel != 16) {
       result = stbi__convert_8_to_16((stbi_uc *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
       ri.bits_per_channel = 16;
+      if (result == NULL) return NULL;
    }
 
+   if (s->half && !ri.half)
+      stbi__unorm16_row((stbi__uint16 *) result, (stbi__uint32) *x * *y * (req_comp ? req_comp : *comp), 0, 1);
+
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1290,15 +2525,201 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    return (stbi__uint16 *) result;
 }
 
-#if !defined(STBI_NO_HDR) && !defined(STBI_NO_LINEAR)
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+static int stbi__stream_begin(stbi__stream *st, int x, int y, int comp, int n)
+{
+   st->x = x;
+   st->y = y;
+   st->comp = comp;
+   st->row_bytes = x * n;
+   st->row_x = 0;
+   if (st->x1 == 0) {
+      st->x0 = st->y0 = 0;
+      st->x1 = x;
+      st->y1 = y;
+   } else if (st->x1 > x || st->y1 > y)
+      return stbi__err("bad region", "Region outside of image");
+   if (st->dest) {
+      if (st->pitch == 0) st->pitch = st->row_bytes;
+      if (st->pitch < st->row_bytes || (size_t) st->pitch * (y-1) + st->row_bytes > (size_t) st->dest_size)
+         return stbi__err("too small", "Image doesn't fit the destination");
+   }
+   if (st->cb.begin && !st->cb.begin(st->user, x, y, comp, n))
+      return stbi__err("cancelled", "Cancelled by callback");
+   return 1;
+}
+
+// stbi_load_into: where row y (in decoding order) goes
+static stbi_uc *stbi__stream_dest_row(stbi__stream *st, int y)
 {
-   if (stbi__vertically_flip_on_load && result != NULL) {
-      int channels = req_comp ? req_comp : *comp;
-      stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
+   if (st->flip) y = st->y-1 - y;
+   return st->dest + (size_t) y * st->pitch;
+}
+
+// stbi_load_into: the row a decoder that sets st->direct should write row y
+// into, or NULL if it has to hand it to stbi__stream_rows after all. a byte
+// written past the end of a row is only harmless if it's the first byte of
+// the row written next
+static stbi_uc *stbi__stream_direct(stbi__stream *st, int y)
+{
+   if (!st->dest || !st->direct) return NULL;
+   if (st->overrun && (st->flip || st->pitch != st->row_bytes || y == st->y-1))
+      return NULL;
+   return stbi__stream_dest_row(st, y);
+}
+
+// hand out 'count' rows starting at row y (in decoding order)
+static int stbi__stream_rows(stbi__stream *st, int y, int count, stbi_uc const *data)
+{
+   if (st->dest) {
+      int k;
+      for (k=0; k < count; ++k)
+         if (!stbi__stream_direct(st, y+k))
+            memcpy(stbi__stream_dest_row(st, y+k), data + (size_t) k * st->row_bytes, st->row_bytes);
+   } else if (st->flip) {
+      int k;
+      for (k=0; k < count; ++k)
+         if (!st->cb.rows(st->user, st->y-1 - (y+k), 1, data + (size_t) k * st->row_bytes))
+            return stbi__err("cancelled", "Cancelled by callback");
+   } else if (!st->cb.rows(st->user, y, count, data))
+      return stbi__err("cancelled", "Cancelled by callback");
+   return 1;
+}
+
+static int stbi__load_stream_main(stbi__context *s, stbi__stream *st, int req_comp)
+{
+   stbi__result_info ri;
+   void *result;
+   int x, y, comp, n;
+
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   st->done = 0;
+   st->direct = st->overrun = 0;
+   st->flip = s->opt.flip_vertically;
+   s->stream = st;
+   result = stbi__load_main(s, &x, &y, &comp, req_comp, &ri, 8);
+   s->stream = NULL;
+   if (st->done)
+      return 1;
+   if (result == NULL)
+      return 0;
+
+   // the decoder couldn't stream this image, so hand it out in one go
+   n = req_comp ? req_comp : comp;
+   if (ri.bits_per_channel != 8) {
+      result = stbi__convert_16_to_8((stbi__uint16 *) result, x, y, n);
+      if (result == NULL) return 0;
    }
+   if (!stbi__stream_begin(st, x, y, comp, n) || !stbi__stream_rows(st, 0, y, (stbi_uc *) result)) {
+      stbi__free(result);
+      return 0;
+   }
+   stbi__free(result);
+   return 1;
+}
+
+static int stbi__load_rows_main(stbi__context *s, stbi_row_callbacks const *rcb, void *user, int req_comp)
+{
+   stbi__stream st;
+   st.cb = *rcb;
+   st.user = user;
+   st.x1 = 0;
+   st.dest = NULL;
+   return stbi__load_stream_main(s, &st, req_comp);
+}
+
+static int stbi__load_into_main(stbi__context *s, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__stream st;
+   if (!dest || dest_size < 0 || pitch < 0) return stbi__err("bad destination", "Invalid destination buffer");
+   st.cb.begin = NULL;
+   st.cb.rows = NULL;
+   st.user = NULL;
+   st.x1 = 0;
+   st.dest = (stbi_uc *) dest;
+   st.dest_size = dest_size;
+   st.pitch = pitch;
+   if (!stbi__load_stream_main(s, &st, req_comp)) return 0;
+   *x = st.x;
+   *y = st.y;
+   if (comp) *comp = st.comp;
+   return 1;
+}
+
+static stbi_uc *stbi__load_ycbcr_main(stbi__context *s, int *x, int *y, stbi_planes *planes)
+{
+   #ifndef STBI_NO_JPEG
+   if (stbi__jpeg_test(s)) return stbi__jpeg_load_ycbcr(s,x,y,planes);
+   #else
+   STBI_NOTUSED(s);
+   STBI_NOTUSED(x);
+   STBI_NOTUSED(y);
+   STBI_NOTUSED(planes);
+   #endif
+   return stbi__errpuc("not YCbCr", "Only YCbCr and grayscale JPEGs have planes");
+}
+
+// stbi_load_region: a stream that copies the wanted rectangle out of the rows
+typedef struct
+{
+   stbi__stream *st;
+   stbi_uc *out;
+   int x, y, w, h;  // region, with y as the rows are handed out
+   int n, img_x, img_y, comp;
+} stbi__region_sink;
+
+static int stbi__region_begin(void *user, int x, int y, int comp, int n)
+{
+   stbi__region_sink *r = (stbi__region_sink *) user;
+   r->img_x = x;
+   r->img_y = y;
+   r->comp = comp;
+   r->n = n;
+   if (r->st->flip)
+      r->y = y - r->y - r->h;
+   r->out = (stbi_uc *) stbi__malloc_mad3(r->w, r->h, n, 0);
+   return r->out != NULL;
+}
+
+static int stbi__region_rows(void *user, int y, int num_rows, stbi_uc const *data)
+{
+   stbi__region_sink *r = (stbi__region_sink *) user;
+   int k, row = r->w * r->n;
+   for (k=0; k < num_rows; ++k) {
+      int j = y + k - r->y;
+      if (j >= 0 && j < r->h)
+         memcpy(r->out + (size_t) j * row, data + (size_t) k * r->st->row_bytes + (r->x - r->st->row_x) * r->n, row);
+   }
+   return 1;
+}
+
+static stbi_uc *stbi__load_region_main(stbi__context *s, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   static const stbi_row_callbacks sink = { stbi__region_begin, stbi__region_rows };
+   stbi__stream st;
+   stbi__region_sink r;
+
+   if (rx < 0 || ry < 0 || rw <= 0 || rh <= 0 || rw > STBI_MAX_DIMENSIONS - rx || rh > STBI_MAX_DIMENSIONS - ry)
+      return stbi__errpuc("bad region", "Region outside of image");
+   r.st = &st;
+   r.out = NULL;
+   r.n = 0;
+   r.x = rx; r.y = ry;
+   r.w = rw; r.h = rh;
+   st.cb = sink;
+   st.user = &r;
+   st.dest = NULL;
+   st.x0 = rx; st.y0 = ry;
+   st.x1 = rx + rw; st.y1 = ry + rh;
+   if (!stbi__load_stream_main(s, &st, req_comp)) {
+      if (r.n && !r.out) return stbi__errpuc("outofmem", "Out of memory");
+      stbi__free(r.out);
+      return NULL;
+   }
+   *x = r.img_x;
+   *y = r.img_y;
+   if (comp) *comp = r.comp;
+   return r.out;
 }
-#endif
 
 #ifndef STBI_NO_STDIO
 
@@ -1339,26 +2760,411 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
 #else
    f = fopen(filename, mode);
 #endif
-   return f;
+   return f;
+}
+
+#ifndef STBI_NO_MMAP
+// A file loaded by name is mapped and handed to the memory path, which reads
+// it in place instead of refilling a 128-byte buffer through fread. Mapping
+// has a fixed cost of a few system calls and page faults, so files smaller
+// than STBI__MAP_MIN are read whole into a buffer with a single read instead.
+// Anything that isn't a regular file (pipes, devices), empty files and files
+// over 2GB make stbi__map_file return 0, and the caller streams them through
+// stbi__fopen.
+#define STBI__MAP_MIN  (256 << 10)
+
+typedef struct
+{
+   stbi_uc *data;
+   int len;
+   int mapped;   // 0: data was read into a scratch buffer of this cache
+   stbi__scratch_cache *scratch;
+} stbi__mapped_file;
+
+// dec: the decoder the file will be loaded with, whose cache the buffer goes to
+static int stbi__map_file(stbi__mapped_file *m, char const *filename, stbi_decoder *dec)
+{
+#ifdef _WIN32
+   HANDLE file, mapping;
+   LARGE_INTEGER size;
+   DWORD got;
+#ifdef STBI_WINDOWS_UTF8
+   wchar_t wFilename[1024];
+#endif
+   // leave device paths such as named pipes to stdio, connecting here would
+   // use up the pipe instance
+   if (filename[0] == '\\' && filename[1] == '\\' && filename[2] == '.') return 0;
+#ifdef STBI_WINDOWS_UTF8
+   if (0 == MultiByteToWideChar(65001 /* UTF8 */, 0, filename, -1, wFilename, sizeof(wFilename)/sizeof(*wFilename)))
+      return 0;
+   file = CreateFileW(wFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+   file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+   if (file == INVALID_HANDLE_VALUE) return 0;
+   m->data = NULL;
+   if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= INT_MAX) {
+      m->len = (int) size.QuadPart;
+      m->mapped = m->len >= STBI__MAP_MIN;
+      if (m->mapped) {
+         mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+         if (mapping) {
+            // the view keeps the mapping and the file open
+            m->data = (stbi_uc *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+         }
+      } else {
+         m->scratch = stbi__scratch_for(dec);
+         m->data = (stbi_uc *) stbi__scratch_malloc(m->scratch, m->len);
+         if (m->data && !(ReadFile(file, m->data, (DWORD) m->len, &got, NULL) && got == (DWORD) m->len)) {
+            stbi__scratch_free(m->scratch, m->data);
+            m->data = NULL;
+         }
+      }
+   }
+   CloseHandle(file);
+   return m->data != NULL;
+#else
+   struct stat st;
+   int fd, got, r;
+   // opening a FIFO would take the writer's data away from the stdio fallback,
+   // so only open what is already known to be a regular file
+   if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) return 0;
+   m->data = NULL;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX) {
+      m->len = (int) st.st_size;
+      m->mapped = m->len >= STBI__MAP_MIN;
+      if (m->mapped) {
+         void *p = mmap(NULL, (size_t) m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (p != MAP_FAILED) m->data = (stbi_uc *) p;
+      } else {
+         m->scratch = stbi__scratch_for(dec);
+         m->data = (stbi_uc *) stbi__scratch_malloc(m->scratch, m->len);
+         for (got = 0; m->data && got < m->len; got += r) {
+            r = (int) read(fd, m->data + got, (size_t) (m->len - got));
+            if (r <= 0) {
+               stbi__scratch_free(m->scratch, m->data);
+               m->data = NULL;
+            }
+         }
+      }
+   }
+   close(fd);
+   return m->data != NULL;
+#endif
+}
+
+static void stbi__unmap_file(stbi__mapped_file *m)
+{
+   if (!m->mapped) {
+      stbi__scratch_free(m->scratch, m->data);
+      return;
+   }
+#ifdef _WIN32
+   UnmapViewOfFile(m->data);
+#else
+   munmap(m->data, (size_t) m->len);
+#endif
+}
+#endif // !STBI_NO_MMAP
+
+
+STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_from_memory(m.data,m.len,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_from_file(f,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   FILE *f;
+   unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_scaled_from_memory(m.data,m.len,x,y,comp,req_comp,scale);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_scaled_from_file(f,x,y,comp,req_comp,scale);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_scaled_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   unsigned char *result;
+   stbi__context s;
+   if (!stbi__valid_scale(scale)) return stbi__errpuc("bad scale", "Scale must be 1, 2, 4 or 8");
+   stbi__start_file(&s,f);
+   s.jpeg_scale = scale;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF int stbi_load_rows(char const *filename, stbi_row_callbacks const *rcb, void *rows_user, int req_comp)
+{
+   FILE *f;
+   int result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_rows_from_memory(m.data,m.len,rcb,rows_user,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_rows_from_file(f,rcb,rows_user,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_rows_from_file(FILE *f, stbi_row_callbacks const *rcb, void *rows_user, int req_comp)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_rows_main(&s,rcb,rows_user,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF int stbi_load_into(char const *filename, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   int result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_into_from_memory(m.data,m.len,dest,dest_size,pitch,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_into_from_file(f,dest,dest_size,pitch,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_into_from_file(FILE *f, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_decoder_load(stbi_decoder *dec, char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   stbi__context s;
+   unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, dec)) {
+      result = stbi_decoder_load_from_memory(dec,m.data,m.len,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   stbi__use_decoder(&s, dec);
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_decoder_load_into(stbi_decoder *dec, char const *filename, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   stbi__context s;
+   int result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, dec)) {
+      result = stbi_decoder_load_into_from_memory(dec,m.data,m.len,dest,dest_size,pitch,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   stbi__use_decoder(&s, dec);
+   result = stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_ex(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   FILE *f;
+   stbi__context s;
+   unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, opt ? opt->decoder : NULL)) {
+      result = stbi_load_from_memory_ex(m.data,m.len,x,y,comp,req_comp,opt);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__use_options(&s,opt) ? stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp) : NULL;
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_us *stbi_load_16_ex(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   FILE *f;
+   stbi__context s;
+   stbi__uint16 *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, opt ? opt->decoder : NULL)) {
+      result = stbi_load_16_from_memory_ex(m.data,m.len,x,y,comp,req_comp,opt);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__use_options(&s,opt) ? stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp) : NULL;
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_into_ex(char const *filename, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   FILE *f;
+   stbi__context s;
+   int result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, opt ? opt->decoder : NULL)) {
+      result = stbi_load_into_from_memory_ex(m.data,m.len,dest,dest_size,pitch,x,y,comp,req_comp,opt);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__use_options(&s,opt) && stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_ycbcr(char const *filename, int *x, int *y, stbi_planes *planes)
+{
+   FILE *f;
+   unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_ycbcr_from_memory(m.data,m.len,x,y,planes);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_ycbcr_from_file(f,x,y,planes);
+   fclose(f);
+   return result;
 }
 
+STBIDEF stbi_uc *stbi_load_ycbcr_from_file(FILE *f, int *x, int *y, stbi_planes *planes)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_ycbcr_main(&s,x,y,planes);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
 
-STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_region_from_memory(m.data,m.len,rx,ry,rw,rh,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file(f,x,y,comp,req_comp);
+   result = stbi_load_region_from_file(f,rx,ry,rw,rh,x,y,comp,req_comp);
    fclose(f);
    return result;
 }
 
-STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_region_from_file(FILE *f, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
 {
    unsigned char *result;
    stbi__context s;
    stbi__start_file(&s,f);
-   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   result = stbi__load_region_main(&s,rx,ry,rw,rh,x,y,comp,req_comp);
    if (result) {
       // need to 'unget' all the characters in the IO buffer
       fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
@@ -1381,8 +3187,17 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    stbi__uint16 *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_16_from_memory(m.data,m.len,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file_16(f,x,y,comp,req_comp);
    fclose(f);
@@ -1420,6 +3235,409 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_scaled_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   stbi__context s;
+   if (!stbi__valid_scale(scale)) return stbi__errpuc("bad scale", "Scale must be 1, 2, 4 or 8");
+   stbi__start_mem(&s,buffer,len);
+   s.jpeg_scale = scale;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_scaled_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   stbi__context s;
+   if (!stbi__valid_scale(scale)) return stbi__errpuc("bad scale", "Scale must be 1, 2, 4 or 8");
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   s.jpeg_scale = scale;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, stbi_row_callbacks const *rcb, void *rows_user, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_rows_main(&s,rcb,rows_user,req_comp);
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_row_callbacks const *rcb, void *rows_user, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_rows_main(&s,rcb,rows_user,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_decoder *stbi_decoder_create(void)
+{
+   stbi_decoder *dec = (stbi_decoder *) stbi__malloc(sizeof(stbi_decoder));
+   if (!dec) return (stbi_decoder *) stbi__errpuc("outofmem", "Out of memory");
+   memset(dec, 0, sizeof(*dec));
+   return dec;
+}
+
+STBIDEF void stbi_decoder_destroy(stbi_decoder *dec)
+{
+   if (!dec) return;
+   stbi__free(dec->jpeg);
+   stbi__free(dec->zlib);
+   stbi__scratch_release(&dec->scratch);
+   stbi__free(dec);
+}
+
+STBIDEF stbi_uc *stbi_decoder_load_from_memory(stbi_decoder *dec, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   stbi__use_decoder(&s, dec);
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_decoder_load_from_callbacks(stbi_decoder *dec, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   stbi__use_decoder(&s, dec);
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_decoder_load_into_from_memory(stbi_decoder *dec, stbi_uc const *buffer, int len, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   stbi__use_decoder(&s, dec);
+   return stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_decoder_load_into_from_callbacks(stbi_decoder *dec, stbi_io_callbacks const *clbk, void *user, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   stbi__use_decoder(&s, dec);
+   return stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__use_options(&s,opt)) return NULL;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   if (!stbi__use_options(&s,opt)) return NULL;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_us *stbi_load_16_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__use_options(&s,opt)) return NULL;
+   return stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_us *stbi_load_16_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   if (!stbi__use_options(&s,opt)) return NULL;
+   return stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_memory_ex(stbi_uc const *buffer, int len, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__use_options(&s,opt)) return 0;
+   return stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, void *dest, int dest_size, int pitch, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   if (!stbi__use_options(&s,opt)) return 0;
+   return stbi__load_into_main(&s,dest,dest_size,pitch,x,y,comp,req_comp);
+}
+
+// stbi_load_batch: decode one item, with the batch's settings and the
+// calling thread's decoder
+static stbi_uc *stbi__batch_decode(stbi__batch *b, stbi__context *s, stbi_batch_item *it, stbi_decoder *dec)
+{
+   if (!stbi__use_options(s, &b->opt)) return NULL;
+   stbi__use_decoder(s, dec);
+   s->batch = b;
+   return stbi__load_and_postprocess_8bit(s, &it->x, &it->y, &it->channels_in_file, b->req_comp);
+}
+
+static stbi_uc *stbi__batch_load(stbi__batch *b, stbi_batch_item *it, stbi_decoder *dec)
+{
+   stbi__context s;
+#ifndef STBI_NO_STDIO
+   FILE *f;
+   stbi_uc *data;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+#endif
+#endif
+   if (!it->filename) {
+      stbi__start_mem(&s, it->buffer, it->len);
+      return stbi__batch_decode(b, &s, it, dec);
+   }
+#ifndef STBI_NO_STDIO
+#ifndef STBI_NO_MMAP
+   if (stbi__map_file(&m, it->filename, dec)) {
+      stbi__start_mem(&s, m.data, m.len);
+      data = stbi__batch_decode(b, &s, it, dec);
+      stbi__unmap_file(&m);
+      return data;
+   }
+#endif
+   f = stbi__fopen(it->filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s, f);
+   data = stbi__batch_decode(b, &s, it, dec);
+   fclose(f);
+   return data;
+#else
+   return stbi__errpuc("can't fopen", "Unable to open file");
+#endif
+}
+
+static void stbi__batch_item(stbi__batch *b, int i, stbi_decoder *dec)
+{
+   stbi_batch_item *it = &b->items[i];
+   it->x = it->y = it->channels_in_file = 0;
+   stbi__g_failure_reason = NULL;
+   it->data = stbi__batch_load(b, it, dec);
+   it->failure_reason = it->data ? NULL : stbi__g_failure_reason;
+}
+
+#ifdef STBI_THREADS
+// the next item for thread w, from its own run or else stolen from the
+// longest run left; returns 0 once all runs are empty
+static int stbi__batch_next(stbi__batch *b, int w, int *item)
+{
+   int k, v, left, most;
+   stbi__mutex_lock(&b->run[w].lock);
+   left = b->run[w].hi - b->run[w].lo;
+   if (left > 0) *item = b->run[w].lo++;
+   stbi__mutex_unlock(&b->run[w].lock);
+   if (left > 0) return 1;
+   for (;;) {
+      v = -1;
+      most = 0;
+      for (k=0; k < b->nthreads; ++k) {
+         if (k == w) continue;
+         stbi__mutex_lock(&b->run[k].lock);
+         left = b->run[k].hi - b->run[k].lo;
+         stbi__mutex_unlock(&b->run[k].lock);
+         if (left > most) { most = left; v = k; }
+      }
+      if (v < 0) return 0;
+      // take the back half, rounded up; the owner goes on from the front
+      stbi__mutex_lock(&b->run[v].lock);
+      left = b->run[v].hi - b->run[v].lo;
+      if (left > 0) {
+         int lo = b->run[v].hi - (left+1)/2, hi = b->run[v].hi;
+         b->run[v].hi = lo;
+         stbi__mutex_unlock(&b->run[v].lock);
+         stbi__mutex_lock(&b->run[w].lock);
+         b->run[w].lo = lo + 1;
+         b->run[w].hi = hi;
+         stbi__mutex_unlock(&b->run[w].lock);
+         *item = lo;
+         return 1;
+      }
+      stbi__mutex_unlock(&b->run[v].lock); // emptied meanwhile, look again
+   }
+}
+
+// take a parallel job off the help list (with b->lock held)
+static void stbi__batch_unlist(stbi__batch *b, stbi__parallel_job *job)
+{
+   int k;
+   for (k=0; k < b->nhelp; ++k) {
+      if (b->help[k] == job) {
+         b->help[k] = b->help[--b->nhelp];
+         break;
+      }
+   }
+}
+
+#ifndef STBI_NO_JPEG
+// stbi__parallel_for inside a batch: list the job for idle threads to join,
+// work on it here as well, and wait for whoever joined
+static void stbi__batch_parallel(stbi__batch *b, stbi__parallel_job *job)
+{
+   stbi__mutex_lock(&b->lock);
+   b->help[b->nhelp++] = job;
+   if (b->idle) stbi__cond_broadcast(&b->cond);
+   stbi__mutex_unlock(&b->lock);
+   stbi__parallel_work(job);
+   stbi__mutex_lock(&b->lock);
+   stbi__batch_unlist(b, job);
+   while (job->helpers)
+      stbi__cond_wait(&b->cond, &b->lock);
+   stbi__mutex_unlock(&b->lock);
+}
+#endif
+
+static void stbi__batch_worker(stbi__batch *b, int w)
+{
+   stbi_decoder *dec = (w == 0 && b->opt.decoder) ? b->opt.decoder : stbi_decoder_create();
+   int i;
+   stbi__mutex_lock(&b->lock);
+   ++b->busy;
+   stbi__mutex_unlock(&b->lock);
+   for (;;) {
+      stbi__parallel_job *job = NULL;
+      if (stbi__batch_next(b, w, &i)) {
+         stbi__batch_item(b, i, dec);
+         // idle threads may find something to steal now
+         stbi__mutex_lock(&b->lock);
+         if (b->idle) stbi__cond_broadcast(&b->cond);
+         stbi__mutex_unlock(&b->lock);
+         continue;
+      }
+      stbi__mutex_lock(&b->lock);
+      --b->busy;
+      if (!b->nhelp && b->busy) {
+         ++b->idle;
+         stbi__cond_wait(&b->cond, &b->lock);
+         --b->idle;
+      }
+      if (b->nhelp) {
+         job = b->help[b->nhelp-1];
+         ++job->helpers;
+      } else if (!b->busy) {
+         // nobody is decoding, so no more work can turn up
+         stbi__cond_broadcast(&b->cond);
+         stbi__mutex_unlock(&b->lock);
+         break;
+      }
+      ++b->busy;
+      stbi__mutex_unlock(&b->lock);
+      if (job) {
+         stbi__parallel_work(job);
+         stbi__mutex_lock(&b->lock);
+         stbi__batch_unlist(b, job); // all its calls are taken, so don't come back
+         if (--job->helpers == 0) stbi__cond_broadcast(&b->cond);
+         stbi__mutex_unlock(&b->lock);
+      }
+   }
+   if (dec != b->opt.decoder) stbi_decoder_destroy(dec);
+}
+
+static void stbi__batch_thread(void *user, int index)
+{
+   stbi__batch_worker((stbi__batch *) user, index + 1);
+}
+#endif // STBI_THREADS
+
+STBIDEF int stbi_load_batch(stbi_batch_item *items, int count, int req_comp, stbi_load_options const *opt)
+{
+   stbi__batch b;
+   int i, loaded = 0;
+#ifdef STBI_THREADS
+   stbi__thread threads[STBI_MAX_THREADS];
+   stbi__parallel_job job;
+   int started = 0;
+#else
+   stbi_decoder *dec;
+#endif
+
+   if (count <= 0) return 0;
+   b.items = items;
+   b.req_comp = req_comp;
+   if (opt) b.opt = *opt; else stbi_load_options_init(&b.opt);
+#ifdef STBI_THREADS
+   // even with fewer images than threads: the rest help with the large ones
+   b.nthreads = stbi__thread_count();
+   for (i=0; i < b.nthreads; ++i) {
+      int per = count / b.nthreads, extra = count % b.nthreads;
+      b.run[i].lo = i * per + (i < extra ? i : extra);
+      b.run[i].hi = b.run[i].lo + per + (i < extra);
+      stbi__mutex_init(&b.run[i].lock);
+   }
+   stbi__mutex_init(&b.lock);
+   stbi__cond_init(&b.cond);
+   b.busy = b.idle = b.nhelp = 0;
+   // the calling thread is worker 0, the others take their numbers from job
+   job.func = stbi__batch_thread;
+   job.user = &b;
+   job.count = b.nthreads - 1;
+   job.next = 0;
+   stbi__mutex_init(&job.lock);
+   for (i=0; i < b.nthreads-1; ++i) {
+      if (!stbi__thread_start(&threads[started], &job)) break;
+      ++started;
+   }
+   stbi__batch_worker(&b, 0);
+   for (i=0; i < started; ++i)
+      stbi__thread_join(threads[i]);
+   stbi__mutex_destroy(&job.lock);
+   stbi__cond_destroy(&b.cond);
+   stbi__mutex_destroy(&b.lock);
+   for (i=0; i < b.nthreads; ++i)
+      stbi__mutex_destroy(&b.run[i].lock);
+#else
+   dec = b.opt.decoder ? b.opt.decoder : stbi_decoder_create();
+   for (i=0; i < count; ++i)
+      stbi__batch_item(&b, i, dec);
+   if (dec != b.opt.decoder) stbi_decoder_destroy(dec);
+#endif
+   for (i=0; i < count; ++i)
+      if (items[i].data) ++loaded;
+   return loaded;
+}
+
+STBIDEF stbi_uc *stbi_load_ycbcr_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_planes *planes)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_ycbcr_main(&s,x,y,planes);
+}
+
+STBIDEF stbi_uc *stbi_load_ycbcr_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, stbi_planes *planes)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_ycbcr_main(&s,x,y,planes);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_region_main(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_region_main(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1428,8 +3646,8 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
    stbi__start_mem(&s,buffer,len);
 
    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-   if (stbi__vertically_flip_on_load) {
-      stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
+   if (result && s.opt.flip_vertically) {
+      stbi__vertical_flip_slices( result, *x, *y, *z, req_comp ? req_comp : 4 );
    }
 
    return result;
@@ -1443,15 +3661,13 @@ static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
       stbi__result_info ri;
-      float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
-      if (hdr_data)
-         stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
-      return hdr_data;
+      s->flip = s->opt.flip_vertically;
+      return stbi__hdr_load(s,x,y,comp,req_comp, &ri); // always writes the rows in the order asked for
    }
    #endif
    data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
    if (data)
-      return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
+      return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp, s->opt.ldr_to_hdr_gamma, s->opt.ldr_to_hdr_scale);
    return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
 }
 
@@ -1469,11 +3685,36 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
    return stbi__loadf_main(&s,x,y,comp,req_comp);
 }
 
+STBIDEF float *stbi_loadf_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__use_options(&s,opt)) return NULL;
+   return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+
+STBIDEF float *stbi_loadf_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   if (!stbi__use_options(&s,opt)) return NULL;
+   return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+
 #ifndef STBI_NO_STDIO
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
+   FILE *f;
    float *result;
-   FILE *f = stbi__fopen(filename, "rb");
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_loadf_from_memory(m.data,m.len,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpf("can't fopen", "Unable to open file");
    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1486,6 +3727,27 @@ STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_
    stbi__start_file(&s,f);
    return stbi__loadf_main(&s,x,y,comp,req_comp);
 }
+
+STBIDEF float *stbi_loadf_ex(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_load_options const *opt)
+{
+   FILE *f;
+   stbi__context s;
+   float *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, opt ? opt->decoder : NULL)) {
+      result = stbi_loadf_from_memory_ex(m.data,m.len,x,y,comp,req_comp,opt);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpf("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__use_options(&s,opt) ? stbi__loadf_main(&s,x,y,comp,req_comp) : NULL;
+   fclose(f);
+   return result;
+}
 #endif // !STBI_NO_STDIO
 
 #endif // !STBI_NO_LINEAR
@@ -1510,8 +3772,17 @@ STBIDEF int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
 #ifndef STBI_NO_STDIO
 STBIDEF int      stbi_is_hdr          (char const *filename)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    int result=0;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_is_hdr_from_memory(m.data,m.len);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (f) {
       result = stbi_is_hdr_from_file(f);
       fclose(f);
@@ -1549,18 +3820,6 @@ STBIDEF int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void
    #endif
 }
 
-#ifndef STBI_NO_LINEAR
-static float stbi__l2h_gamma=2.2f, stbi__l2h_scale=1.0f;
-
-STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
-STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
-#endif
-
-static float stbi__h2l_gamma_i=1.0f/2.2f, stbi__h2l_scale_i=1.0f;
-
-STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i = 1/gamma; }
-STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i = 1/scale; }
-
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1640,7 +3899,7 @@ static void stbi__skip(stbi__context *s, int n)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_HDR) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_PNM)
 // nothing
 #else
 static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
@@ -1723,56 +3982,168 @@ static stbi__uint32 stbi__get32le(stbi__context *s)
 //  assume data buffer is malloced, so malloc a new one and free that one
 //  only failure mode is malloc failing
 
-static stbi_uc stbi__compute_y(int r, int g, int b)
+static stbi_uc stbi__compute_y(int r, int g, int b)
+{
+   return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
+}
+#endif
+
+#if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+// nothing
+#else
+#ifdef STBI_SSSE3
+// convert the leading pixels of a row with byte shuffles and return how
+// many were done; bytes is the size of a sample (1 or 2). each step loads
+// 16 bytes, and never stores past the bytes it loaded, so a row that gets
+// shorter can be converted in place. the remaining pixels are left to the
+// scalar loops
+static STBI__SSSE3_TARGET int stbi__convert_row_ssse3(stbi_uc *src, stbi_uc *dest, int img_n, int req_comp, int x, int bytes)
+{
+   // tab[0..3]: shuffles picking out r,g,b,a; tab[4]: bytes to set (255 alpha);
+   // tab[5]: shuffle packing the results. index 0x80 makes pshufb write a zero
+   STBI_SIMD_ALIGN(stbi_uc, tab[6][16]);
+   int in_px = img_n * bytes, out_px = req_comp * bytes;
+   int i, k, b, step, n = 0;
+   memset(tab, 0x80, sizeof(tab));
+   memset(tab[4], 0, 16);
+   if (img_n >= 3 && req_comp <= 2) {
+      // luminance: each pixel gets a 32-bit (8-bit samples) or 64-bit
+      // (16-bit samples) lane holding r,g,b, and the weighted sum ends up
+      // at the bottom of the lane, followed by alpha
+      __m128i cr, cg, cb, ca, fill, pack;
+      int lane = 4 * bytes;
+      step = 16 / lane;
+      for (i=0; i < step; ++i) {
+         for (b=0; b < bytes; ++b) {
+            for (k=0; k < 3; ++k)
+               tab[k][i*lane + b] = (stbi_uc) ((i*img_n + k)*bytes + b);
+            if (req_comp == 2) {
+               if (img_n == 4) tab[3][i*lane + bytes + b] = (stbi_uc) ((i*img_n + 3)*bytes + b);
+               else            tab[4][i*lane + bytes + b] = 255;
+            }
+         }
+         for (b=0; b < out_px; ++b)
+            tab[5][i*out_px + b] = (stbi_uc) (i*lane + b);
+      }
+      cr = _mm_load_si128((__m128i *) tab[0]);
+      cg = _mm_load_si128((__m128i *) tab[1]);
+      cb = _mm_load_si128((__m128i *) tab[2]);
+      ca = _mm_load_si128((__m128i *) tab[3]);
+      fill = _mm_load_si128((__m128i *) tab[4]);
+      pack = _mm_load_si128((__m128i *) tab[5]);
+      for (; (x - n) * in_px >= 16; n += step, src += step*in_px, dest += step*out_px) {
+         __m128i v = _mm_loadu_si128((__m128i *) src), y;
+         if (bytes == 1) {
+            // same as stbi__compute_y; pmaddwd against (w,0) multiplies the low half
+            y = _mm_madd_epi16(_mm_shuffle_epi8(v, cr), _mm_set1_epi32(77));
+            y = _mm_add_epi32(y, _mm_madd_epi16(_mm_shuffle_epi8(v, cg), _mm_set1_epi32(150)));
+            y = _mm_add_epi32(y, _mm_madd_epi16(_mm_shuffle_epi8(v, cb), _mm_set1_epi32(29)));
+            y = _mm_srli_epi32(y, 8);
+         } else {
+            // same as stbi__compute_y_16; the products need more than 16 bits
+            y = _mm_mul_epu32(_mm_shuffle_epi8(v, cr), _mm_set1_epi32(77));
+            y = _mm_add_epi64(y, _mm_mul_epu32(_mm_shuffle_epi8(v, cg), _mm_set1_epi32(150)));
+            y = _mm_add_epi64(y, _mm_mul_epu32(_mm_shuffle_epi8(v, cb), _mm_set1_epi32(29)));
+            y = _mm_srli_epi64(y, 8);
+         }
+         y = _mm_shuffle_epi8(_mm_or_si128(_mm_or_si128(y, _mm_shuffle_epi8(v, ca)), fill), pack);
+         if (step * out_px == 8) {
+            _mm_storel_epi64((__m128i *) dest, y);
+         } else {
+            stbi__uint32 t = (stbi__uint32) _mm_cvtsi128_si32(y);
+            memcpy(dest, &t, 4);
+         }
+      }
+   } else {
+      // everything else just moves samples around, replicates grey and adds
+      // opaque alpha; a step does as many whole pixels as fit in 16 bytes
+      // both before and after, and the store's tail is overwritten by the
+      // next step or left in the bytes the load covered
+      __m128i ctrl, fill;
+      step = 16 / (in_px > out_px ? in_px : out_px);
+      for (i=0; i < step * out_px; ++i) {
+         int c = (i / bytes) % req_comp;
+         int sc = img_n >= 3 ? c : 0;
+         if (c == 3 || (c == 1 && req_comp == 2)) {
+            // alpha
+            if (img_n == 2 || img_n == 4) sc = img_n-1; else sc = -1;
+         }
+         if (sc < 0) tab[4][i] = 255;
+         else        tab[0][i] = (stbi_uc) (((i / bytes / req_comp) * img_n + sc) * bytes + i % bytes);
+      }
+      ctrl = _mm_load_si128((__m128i *) tab[0]);
+      fill = _mm_load_si128((__m128i *) tab[4]);
+      for (; (x - n) * in_px >= 16 && (x - n) * out_px >= 16; n += step, src += step*in_px, dest += step*out_px)
+         _mm_storeu_si128((__m128i *) dest, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((__m128i *) src), ctrl), fill));
+   }
+   return n;
+}
+#endif
+
+// convert one scanline of x pixels; returns 0 if the combination isn't supported
+static int stbi__convert_row(unsigned char *src, unsigned char *dest, int img_n, int req_comp, unsigned int x)
 {
-   return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
+   int i;
+   #ifdef STBI_SSSE3
+   if (img_n != req_comp && img_n >= 1 && img_n <= 4 && req_comp >= 1 && req_comp <= 4 && stbi__ssse3_available()) {
+      int n = stbi__convert_row_ssse3(src, dest, img_n, req_comp, x, 1);
+      src += n * img_n; dest += n * req_comp; x -= n;
+   }
+   #endif
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
 }
-#endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
-// nothing
-#else
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
-   good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
+   // dropping channels never writes ahead of what's been read, so reuse the buffer
+   if (req_comp < img_n)
+      good = data;
+   else
+      good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row(data + j * x * img_n, good + j * x * req_comp, img_n, req_comp, x)) {
+         if (good != data) stbi__free(good);
+         stbi__free(data); return stbi__errpuc("unsupported", "Unsupported format conversion");
       }
-      #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   if (good == data) {
+      // give back the tail; if that fails the bigger block is still fine
+      good = (unsigned char *) stbi__realloc_sized(data, (size_t) img_n * x * y, (size_t) req_comp * x * y);
+      return good ? good : data;
+   }
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1789,94 +4160,192 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
 #else
+static int stbi__convert_row16(stbi__uint16 *src, stbi__uint16 *dest, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #ifdef STBI_SSSE3
+   if (img_n != req_comp && img_n >= 1 && img_n <= 4 && req_comp >= 1 && req_comp <= 4 && stbi__ssse3_available()) {
+      int n = stbi__convert_row_ssse3((stbi_uc *) src, (stbi_uc *) dest, img_n, req_comp, x, 2);
+      src += n * img_n; dest += n * req_comp; x -= n;
+   }
+   #endif
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
-   good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
+   if (req_comp < img_n)
+      good = data;
+   else
+      good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row16(data + j * x * img_n, good + j * x * req_comp, img_n, req_comp, x)) {
+         if (good != data) stbi__free(good);
+         stbi__free(data); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
       }
-      #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   if (good == data) {
+      good = (stbi__uint16 *) stbi__realloc_sized(data, (size_t) img_n * x * y * 2, (size_t) req_comp * x * y * 2);
+      return good ? good : data;
+   }
+   stbi__free(data);
    return good;
 }
 #endif
 
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp, float gamma, float scale)
 {
    int i,k,n;
    float *output;
+   float lut[256], alpha[256];
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
+   // there are only 256 inputs, so evaluate pow once for each
+   for (i=0; i < 256; ++i) {
+      lut[i] = (float) (pow(i/255.0f, gamma) * scale);
+      alpha[i] = i/255.0f;
+   }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
-      }
-   }
-   if (n < comp) {
+   if (n == comp) {
+      for (i=0; i < x*y*comp; ++i)
+         output[i] = lut[data[i]];
+   } else {
       for (i=0; i < x*y; ++i) {
-         output[i*comp + n] = data[i*comp + n]/255.0f;
+         for (k=0; k < n; ++k)
+            output[i*comp + k] = lut[data[i*comp + k]];
+         output[i*comp + n] = alpha[data[i*comp + n]];
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+static stbi_uc stbi__hdr_to_ldr_1(float f, float gamma_i, float scale_i)
+{
+   float z = (float) pow(f*scale_i, gamma_i) * 255 + 0.5f;
+   if (z < 0) z = 0;
+   if (z > 255) z = 255;
+   return (stbi_uc) stbi__float2int(z);
+}
+
+// with a positive gamma and scale, stbi__hdr_to_ldr_1 never decreases as
+// its input grows, and for positive floats neither do their bit patterns.
+// so it's fully described by the 255 patterns where its result first
+// reaches 1, 2, ..., 255; these take ~8000 pow calls to find instead of
+// one per sample. a table on the top bits of the pattern gives the result
+// at the start of each bucket, and a sample steps past whatever thresholds
+// lie between that and itself (rarely more than one)
+typedef struct
+{
+   stbi__uint32 t[257];          // t[k]: first pattern giving k; t[256] ends the scan
+   int shift;                    // bucket = pattern >> shift
+   stbi__uint32 base, nbuckets;
+   float gamma_i, scale_i;
+   stbi_uc bucket[4096];
+} stbi__h2l_table;
+
+static void stbi__h2l_build(stbi__h2l_table *h, float gamma_i, float scale_i)
+{
+   stbi__uint32 lo, hi, mid, b;
+   int k;
+   float f;
+   h->gamma_i = gamma_i;
+   h->scale_i = scale_i;
+   h->t[0] = 0;
+   for (k=1; k < 256; ++k) {
+      // smallest pattern in [t[k-1], +inf] that maps to >= k; +inf maps to 255
+      lo = h->t[k-1];
+      hi = 0x7f800000;
+      while (lo < hi) {
+         mid = lo + (hi - lo) / 2;
+         memcpy(&f, &mid, 4);
+         if (stbi__hdr_to_ldr_1(f, gamma_i, scale_i) >= k) hi = mid; else lo = mid + 1;
+      }
+      h->t[k] = lo;
+   }
+   h->t[256] = 0xffffffff;
+   h->shift = 16;
+   while (((h->t[255] >> h->shift) - (h->t[1] >> h->shift)) >= 4096)
+      ++h->shift;
+   h->base = h->t[1] >> h->shift;
+   h->nbuckets = (h->t[255] >> h->shift) - h->base + 1;
+   for (b=0, k=1; b < h->nbuckets; ++b) {
+      stbi__uint32 start = (h->base + b) << h->shift;
+      while (k < 256 && h->t[k] <= start) ++k;
+      h->bucket[b] = (stbi_uc) (k-1);
+   }
+}
+
+static stbi_uc stbi__h2l_lookup(stbi__h2l_table const *h, float f)
+{
+   stbi__uint32 u;
+   int k;
+   memcpy(&u, &f, 4);
+   if (u > 0x7f800000) return stbi__hdr_to_ldr_1(f, h->gamma_i, h->scale_i); // negative or nan
+   if (u < h->t[1]) return 0;
+   if (u >= h->t[255]) return 255;
+   k = h->bucket[(u >> h->shift) - h->base];
+   while (u >= h->t[k+1]) ++k;
+   return (stbi_uc) k;
+}
+
+static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp, float gamma, float scale)
 {
    int i,k,n;
    stbi_uc *output;
+   stbi__h2l_table *h = NULL;
+   float gamma_i = 1/gamma, scale_i = 1/scale;
    if (!data) return NULL;
    output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   // not worth it for tiny images, and needs a sane gamma and scale
+   if (x*y*comp >= 4096 && gamma_i > 0 && scale_i > 0 && gamma_i < 1e30f && scale_i < 1e30f) {
+      h = (stbi__h2l_table *) stbi__malloc(sizeof(*h));
+      if (h) stbi__h2l_build(h, gamma_i, scale_i);
+   }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = (stbi_uc) stbi__float2int(z);
-      }
+      for (k=0; k < n; ++k)
+         output[i*comp + k] = h ? stbi__h2l_lookup(h, data[i*comp+k]) : stbi__hdr_to_ldr_1(data[i*comp+k], gamma_i, scale_i);
       if (k < comp) {
          float z = data[i*comp+k] * 255 + 0.5f;
          if (z < 0) z = 0;
@@ -1884,7 +4353,8 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   stbi__free(h);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1913,7 +4383,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   11 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1933,6 +4403,14 @@ typedef struct
    stbi__huffman huff_ac[4];
    stbi__uint16 dequant[4][64];
    stbi__int16 fast_ac[4][1 << FAST_BITS];
+   // what each table (DC 0-3, AC 0-3) was built from: the 16 code counts
+   // followed by the symbols; dht_len 0 if it wasn't. an identical DHT
+   // doesn't rebuild it, which is what makes keeping a stbi__jpeg in a
+   // stbi_decoder worthwhile
+   int dht_len[8];
+   stbi_uc dht[8][16+256];
+   int dht_defined; // bit k set once this image has defined table k; a scan may only use those
+   int dqt_defined; // the same for the quantization tables
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
@@ -1954,9 +4432,10 @@ typedef struct
       stbi_uc *linebuf;
       short   *coeff;   // progressive only
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+      int      dct_w, dct_h; // size of the blocks the IDCT outputs, see stbi__jpeg_comp_dct
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, next bit in the MSB
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1973,11 +4452,19 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int dct_size; // 8, or 4/2/1 when decoding at a reduced scale (of the full-size planes)
+   int mcu_rows; // MCU rows the component planes hold; fewer than img_mcu_y makes them a ring
+   void *stream; // stbi__jpeg_stream, when handing out rows as they are decoded
+   int roi_mx0, roi_mx1, roi_my0, roi_my1; // MCUs that get reconstructed, see stbi_load_region
+   int roi_done; // decoded everything the region needs; stop reading
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block2_kernel)(stbi_uc *out0, stbi_uc *out1, int out_stride, short data[128]); // optional
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+   void (*YCbCr_hv_2_to_RGB_kernel)(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int count, int step); // optional
+   int simd; // what stbi__setup_jpeg found the CPU supports, -1 until it has checked
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -2027,23 +4514,27 @@ static int stbi__build_huffman(stbi__huffman *h, int *count)
 static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 {
    int i;
-   for (i=0; i < (1 << FAST_BITS); ++i) {
-      stbi_uc fast = h->fast[i];
-      fast_ac[i] = 0;
-      if (fast < 255) {
-         int rs = h->values[fast];
-         int run = (rs >> 4) & 15;
-         int magbits = rs & 15;
-         int len = h->size[fast];
-
-         if (magbits && len + magbits <= FAST_BITS) {
-            // magnitude code followed by receive_extend code
-            int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
-            int m = 1 << (magbits - 1);
+   memset(fast_ac, 0, sizeof(fast_ac[0]) << FAST_BITS);
+   // a code followed by its extra bits covers a run of entries; fill each
+   // run instead of decoding every entry on its own
+   for (i=0; h->size[i] && h->size[i] <= FAST_BITS; ++i) {
+      int rs = h->values[i];
+      int run = (rs >> 4) & 15;
+      int magbits = rs & 15;
+      int len = h->size[i];
+
+      if (magbits && len + magbits <= FAST_BITS) {
+         // magnitude code followed by receive_extend code
+         int shift = FAST_BITS - len - magbits, e, j;
+         int m = 1 << (magbits - 1);
+         for (e=0; e < (1 << magbits); ++e) {
+            int k = e;
+            stbi__int16 *p = fast_ac + (h->code[i] << (FAST_BITS - len)) + (e << shift);
             if (k < m) k += (~0U << magbits) + 1;
             // if the result is small enough, we can fit it in fast_ac table
             if (k >= -128 && k <= 127)
-               fast_ac[i] = (stbi__int16) ((k * 256) + (run * 16) + (len + magbits));
+               for (j=0; j < (1 << shift); ++j)
+                  p[j] = (stbi__int16) ((k * 256) + (run * 16) + (len + magbits));
          }
       }
    }
@@ -2051,6 +4542,25 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   // if the next 8 bytes are buffered and none of them is 0xff (so no
+   // markers or stuffed zeros), take as many as fit in one go
+   if (!j->nomore && j->s->img_buffer_end - j->s->img_buffer >= 8 && j->code_bits <= 48) {
+      stbi_uc *p = j->s->img_buffer;
+      stbi__uint32 hi = ((stbi__uint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+      stbi__uint32 lo = ((stbi__uint32) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+      stbi__uint32 nhi = ~hi, nlo = ~lo;
+      // 0xff bytes are zero bytes of the complement; see "haszero" bit hacks
+      if ((((nhi - 0x01010101u) & ~nhi) | ((nlo - 0x01010101u) & ~nlo)) & 0x80808080u) {
+         // fall through to the careful path
+      } else {
+         int n = (63 - j->code_bits) >> 3; // bytes that fit
+         stbi__uint64 v = ((stbi__uint64) hi << 32) | lo;
+         j->code_buffer |= (v >> (64 - 8*n)) << (64 - 8*n - j->code_bits);
+         j->code_bits += 8*n;
+         j->s->img_buffer += n;
+         return;
+      }
+   }
    do {
       unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
       if (b == 0xff) {
@@ -2062,14 +4572,11 @@ static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -2080,7 +4587,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS)) & ((1 << FAST_BITS)-1);
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -2097,7 +4604,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2111,8 +4618,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2131,10 +4638,9 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
    int sgn;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-   sgn = j->code_buffer >> 31; // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> 63); // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & (sgn - 1));
 }
@@ -2144,21 +4650,20 @@ stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
    unsigned int k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2202,7 +4707,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS)) & ((1 << FAST_BITS)-1);
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
@@ -2277,7 +4782,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS)) & ((1 << FAST_BITS)-1);
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2489,6 +4994,86 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// Reduced IDCTs for decoding at 1/2, 1/4 and 1/8 scale. The NWxNH output
+// is the 8x8 IDCT sampled at the centers of its NWxNH groups of pixels, which
+// only depends on the lowest NWxNH coefficients and amounts to an N-point
+// IDCT in each direction. coef[x*n+u] = C(u)/2 * cos((2x+1)*u*pi/(2n)).
+// NW and NH differ for subsampled planes, see stbi__jpeg_comp_dct; 8 points
+// is the plain IDCT, for a plane reduced in one direction only.
+#define stbi__c8_1  stbi__f2f(0.490392640f) // cos(pi/16)/2
+#define stbi__c4_1  stbi__f2f(0.461939766f) // cos(pi/8)/2
+#define stbi__c8_3  stbi__f2f(0.415734806f) // cos(3*pi/16)/2
+#define stbi__c4_0  stbi__f2f(0.353553391f) // 1/(2*sqrt(2))
+#define stbi__c8_5  stbi__f2f(0.277785117f) // cos(5*pi/16)/2
+#define stbi__c4_3  stbi__f2f(0.191341716f) // cos(3*pi/8)/2
+#define stbi__c8_7  stbi__f2f(0.097545161f) // cos(7*pi/16)/2
+
+static const short stbi__idct8_coef[64] =
+{
+   stbi__c4_0,  stbi__c8_1,  stbi__c4_1,  stbi__c8_3,  stbi__c4_0,  stbi__c8_5,  stbi__c4_3,  stbi__c8_7,
+   stbi__c4_0,  stbi__c8_3,  stbi__c4_3, -stbi__c8_7, -stbi__c4_0, -stbi__c8_1, -stbi__c4_1, -stbi__c8_5,
+   stbi__c4_0,  stbi__c8_5, -stbi__c4_3, -stbi__c8_1, -stbi__c4_0,  stbi__c8_7,  stbi__c4_1,  stbi__c8_3,
+   stbi__c4_0,  stbi__c8_7, -stbi__c4_1, -stbi__c8_5,  stbi__c4_0,  stbi__c8_3, -stbi__c4_3, -stbi__c8_1,
+   stbi__c4_0, -stbi__c8_7, -stbi__c4_1,  stbi__c8_5,  stbi__c4_0, -stbi__c8_3, -stbi__c4_3,  stbi__c8_1,
+   stbi__c4_0, -stbi__c8_5, -stbi__c4_3,  stbi__c8_1, -stbi__c4_0, -stbi__c8_7,  stbi__c4_1, -stbi__c8_3,
+   stbi__c4_0, -stbi__c8_3,  stbi__c4_3,  stbi__c8_7, -stbi__c4_0,  stbi__c8_1, -stbi__c4_1,  stbi__c8_5,
+   stbi__c4_0, -stbi__c8_1,  stbi__c4_1, -stbi__c8_3,  stbi__c4_0, -stbi__c8_5,  stbi__c4_3, -stbi__c8_7,
+};
+
+static const short stbi__idct4_coef[16] =
+{
+   stbi__c4_0,  stbi__c4_1,  stbi__c4_0,  stbi__c4_3,
+   stbi__c4_0,  stbi__c4_3, -stbi__c4_0, -stbi__c4_1,
+   stbi__c4_0, -stbi__c4_3, -stbi__c4_0,  stbi__c4_1,
+   stbi__c4_0, -stbi__c4_1,  stbi__c4_0, -stbi__c4_3,
+};
+
+static const short stbi__idct2_coef[4] =
+{
+   stbi__c4_0,  stbi__c4_0,
+   stbi__c4_0, -stbi__c4_0,
+};
+
+static const short stbi__idct1_coef[1] = { stbi__c4_0 };
+
+static const short *stbi__idct_coef(int n)
+{
+   return n == 8 ? stbi__idct8_coef : n == 4 ? stbi__idct4_coef : n == 2 ? stbi__idct2_coef : stbi__idct1_coef;
+}
+
+static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], int nw, int nh)
+{
+   const short *cw = stbi__idct_coef(nw), *ch = stbi__idct_coef(nh);
+   int i,j,k, tmp[64];
+   // columns; keep one fractional bit. real images stay far inside 16 bits
+   // here; clamping keeps 8-point rows of corrupt data from overflowing
+   for (j=0; j < nh; ++j) {
+      for (i=0; i < nw; ++i) {
+         int t = 1 << 10;
+         for (k=0; k < nh; ++k)
+            t += ch[j*nh+k] * data[k*8+i];
+         t >>= 11;
+         tmp[j*nw+i] = t < -32768 ? -32768 : t > 32767 ? 32767 : t;
+      }
+   }
+   // rows, with the +128 level shift folded into the rounding bias
+   for (j=0; j < nh; ++j, out += out_stride) {
+      for (i=0; i < nw; ++i) {
+         int t = (1 << 12) + (128 << 13);
+         for (k=0; k < nw; ++k)
+            t += cw[i*nw+k] * tmp[j*nw+k];
+         out[i] = stbi__clamp(t >> 13);
+      }
+   }
+}
+
+// DC only; same rounding as a flat block through stbi__idct_block
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2668,6 +5253,200 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 #undef dct_pass
 }
 
+#ifdef STBI_AVX2
+static STBI__AVX2_TARGET void stbi__idct2_avx2(stbi_uc *out0, stbi_uc *out1, int out_stride, short data[128])
+{
+   // Same transform as stbi__idct_simd, with the first block in the low
+   // 128-bit lane and the second in the high lane. Every op used below
+   // works within lanes, so this is two independent copies of the SSE2 IDCT.
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   // load row r of both blocks
+   #define dct_load(r) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data + (r)*8))), \
+                              _mm_load_si128((const __m128i *) (data + 64 + (r)*8)), 1)
+
+   // store two output rows of each block
+   #define dct_store2(p) \
+      { \
+         __m128i plo = _mm256_castsi256_si128(p); \
+         __m128i phi = _mm256_extracti128_si256(p, 1); \
+         _mm_storel_epi64((__m128i *) out0, plo); out0 += out_stride; \
+         _mm_storel_epi64((__m128i *) out0, _mm_shuffle_epi32(plo, 0x4e)); out0 += out_stride; \
+         _mm_storel_epi64((__m128i *) out1, phi); out1 += out_stride; \
+         _mm_storel_epi64((__m128i *) out1, _mm_shuffle_epi32(phi, 0x4e)); out1 += out_stride; \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      dct_store2(p0);
+      dct_store2(p2);
+      dct_store2(p1);
+      dct_store2(p3);
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_load
+#undef dct_store2
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_AVX2
+
 #endif // STBI_SSE2
 
 #ifdef STBI_NEON
@@ -2912,13 +5691,218 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// When there is a kernel that transforms two blocks at once, a decoded block
+// waits in the queue until the next block of the same component is decoded,
+// and then both go through the IDCT together.
+typedef struct
+{
+   STBI_SIMD_ALIGN(short, data[4][128]);
+   stbi_uc *out[4];
+} stbi__idct_queue;
+
+// coefficient buffer for the next block of component n
+static short *stbi__idct_queue_slot(stbi__idct_queue *q, int n)
+{
+   return q->data[n] + (q->out[n] ? 64 : 0);
+}
+
+// reconstruct a block of component n at out
+static void stbi__jpeg_idct(stbi__jpeg *z, int n, stbi_uc *out, short data[64])
+{
+   int w = z->img_comp[n].dct_w, h = z->img_comp[n].dct_h;
+   if (w == 8 && h == 8)
+      z->idct_block_kernel(out, z->img_comp[n].w2, data);
+   else if (w == 1 && h == 1)
+      stbi__idct_1x1(out, z->img_comp[n].w2, data);
+   else
+      stbi__idct_reduced(out, z->img_comp[n].w2, data, w, h);
+}
+
+static void stbi__idct_queue_push(stbi__jpeg *z, stbi__idct_queue *q, int n, stbi_uc *out)
+{
+   if (!z->idct_block2_kernel) {
+      stbi__jpeg_idct(z, n, out, q->data[n]);
+   } else if (q->out[n]) {
+      z->idct_block2_kernel(q->out[n], out, z->img_comp[n].w2, q->data[n]);
+      q->out[n] = NULL;
+   } else {
+      q->out[n] = out;
+   }
+}
+
+static void stbi__idct_queue_flush(stbi__jpeg *z, stbi__idct_queue *q)
+{
+   int n;
+   for (n=0; n < 4; ++n) {
+      if (q->out[n]) {
+         stbi__jpeg_idct(z, n, q->out[n], q->data[n]);
+         q->out[n] = NULL;
+      }
+   }
+}
+
+// decode MCUs [first, first+count) of a non-progressive scan; the caller
+// must have positioned the bit reader at the start of the first one
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, stbi__idct_queue *q, int first, int count)
+{
+   int m;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int ha = z->img_comp[n].ha;
+      for (m=first; m < first+count; ++m) {
+         int i = m % w, j = m / w;
+         if (!stbi__jpeg_decode_block(z, stbi__idct_queue_slot(q, n), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         stbi__idct_queue_push(z, q, n, z->img_comp[n].data+z->img_comp[n].w2*j*z->img_comp[n].dct_h+i*z->img_comp[n].dct_w);
+      }
+   } else {
+      int k,x,y;
+      for (m=first; m < first+count; ++m) {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            int ha = z->img_comp[n].ha;
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*z->img_comp[n].dct_w;
+                  int y2 = (j*z->img_comp[n].v + y)*z->img_comp[n].dct_h;
+                  if (!stbi__jpeg_decode_block(z, stbi__idct_queue_slot(q, n), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  stbi__idct_queue_push(z, q, n, z->img_comp[n].data+z->img_comp[n].w2*y2+x2);
+               }
+            }
+         }
+      }
+   }
+   stbi__idct_queue_flush(z, q);
+   return 1;
+}
+
+// starting a thread costs tens of microseconds, about what decoding a few
+// thousand pixels does, so each thread gets at least this many pixels of the
+// image; small images are decoded on the calling thread alone
+#define STBI__THREAD_MIN_PIXELS (1 << 16)
+
+static int stbi__jpeg_threads(stbi__jpeg *z)
+{
+   int n = stbi__load_threads(z->s);
+   size_t most = (size_t) z->s->img_x * z->s->img_y / STBI__THREAD_MIN_PIXELS;
+   if ((size_t) n > most) n = most < 1 ? 1 : (int) most;
+   return n;
+}
+
+// Restart markers split a scan into segments that can be decoded
+// independently: the bit reader and DC predictors are reset at each one.
+// With threads and the whole scan in memory, we find the RSTn markers
+// up front and give each worker a range of segments and its own copy of
+// the decoder state.
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **seg;       // seg[k] is the start of segment k, seg[nseg] the end of the scan
+   int nseg, per_task, total;
+   int failed;
+} stbi__jpeg_segments;
+
+static void stbi__jpeg_decode_segments(void *user, int task)
+{
+   stbi__jpeg_segments *job = (stbi__jpeg_segments *) user;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__idct_queue q;
+   stbi__context s;
+   int k, first = task * job->per_task;
+   int last = first + job->per_task < job->nseg ? first + job->per_task : job->nseg;
+
+   if (!z) { job->failed = 1; return; }
+   memcpy(z, job->z, sizeof(*z));
+   z->s = &s;
+   q.out[0] = q.out[1] = q.out[2] = q.out[3] = NULL;
+   for (k=first; k < last && !job->failed; ++k) {
+      // each segment ends with the marker that terminates it, exactly
+      // what the serial decoder would run into
+      int m = k * z->restart_interval;
+      int count = job->total - m < z->restart_interval ? job->total - m : z->restart_interval;
+      stbi__start_mem(&s, job->seg[k], (int) (job->seg[k+1] - job->seg[k]));
+      stbi__jpeg_reset(z);
+      if (!stbi__jpeg_decode_mcus(z, &q, m, count))
+         job->failed = 1;
+   }
+   stbi__free(z);
+}
+
+static int stbi__jpeg_parallel_scan(stbi__jpeg *z)
+{
+   stbi__jpeg_segments job;
+   stbi_uc *p, *end;
+   int k, nseg, ntasks, threads = stbi__jpeg_threads(z);
+
+   if (threads <= 1 || z->progressive || z->restart_interval <= 0) return 0;
+   if (z->s->io.read) return 0; // need the whole scan in memory
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      job.total = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else
+      job.total = z->img_mcu_x * z->img_mcu_y;
+   nseg = (job.total + z->restart_interval - 1) / z->restart_interval;
+   if (nseg < 2) return 0;
+
+   job.seg = (stbi_uc **) stbi__malloc(sizeof(stbi_uc *) * (nseg+1));
+   if (!job.seg) return 0;
+   job.seg[0] = p = z->s->img_buffer;
+   end = z->s->img_buffer_end;
+   k = 1;
+   for (;;) {
+      stbi_uc c;
+      while (p < end && *p != 0xff) ++p;
+      while (p < end && *p == 0xff) ++p; // marker prefix and fill bytes
+      if (p >= end) break;
+      c = *p++;
+      if (c == 0) continue; // stuffed 0xff data byte
+      if (STBI__RESTART(c) && k < nseg) {
+         job.seg[k++] = p;
+         continue;
+      }
+      if (k == nseg && !STBI__RESTART(c)) {
+         job.seg[k] = p;
+         z->marker = c;
+      }
+      break;
+   }
+   if (z->marker == STBI__MARKER_none) {
+      // restart markers don't match the image size, or no end marker;
+      // let the serial decoder deal with whatever this is
+      stbi__free(job.seg);
+      return 0;
+   }
+
+   job.z = z;
+   job.nseg = nseg;
+   job.failed = 0;
+   ntasks = nseg < threads * 4 ? nseg : threads * 4;
+   job.per_task = (nseg + ntasks - 1) / ntasks;
+   ntasks = (nseg + job.per_task - 1) / job.per_task;
+   stbi__parallel_for(z->s->batch, threads, ntasks, stbi__jpeg_decode_segments, &job);
+   if (job.failed) {
+      // errors are reported per-thread, so redo it serially to get the same failure
+      z->marker = STBI__MARKER_none;
+      stbi__free(job.seg);
+      return 0;
+   }
+   z->s->img_buffer = job.seg[nseg];
+   stbi__free(job.seg);
+   return 1;
+}
+
+static int stbi__jpeg_stream_rows(stbi__jpeg *z, int y1);
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
+   if (!z->stream && stbi__jpeg_parallel_scan(z))
+      return 1;
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
+         stbi__idct_queue q;
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2926,27 +5910,58 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          // component has, independent of interleaved MCU blocking and such
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
+         q.out[0] = q.out[1] = q.out[2] = q.out[3] = NULL;
          for (j=0; j < h; ++j) {
+            int j2 = j % (z->mcu_rows * z->img_comp[n].v);
+            int my = j / z->img_comp[n].v;
+            if (z->stream && z->s->img_n == 1) {
+               stbi__idct_queue_flush(z, &q);
+               if (!stbi__jpeg_stream_rows(z, j*8 - z->img_mcu_h)) return 0;
+               if (j >= z->roi_my1) {
+                  z->roi_done = 1;
+                  return 1;
+               }
+            }
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               int mx = i / z->img_comp[n].h;
+               if (!stbi__jpeg_decode_block(z, stbi__idct_queue_slot(&q, n), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               // blocks away from the region don't need reconstructing
+               if (mx >= z->roi_mx0 && mx < z->roi_mx1 && my >= z->roi_my0 && my < z->roi_my1)
+                  stbi__idct_queue_push(z, &q, n, z->img_comp[n].data+z->img_comp[n].w2*j2*z->img_comp[n].dct_h+i*z->img_comp[n].dct_w);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                   // if it's NOT a restart, then just bail, so we get corrupt data
                   // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) {
+                     stbi__idct_queue_flush(z, &q);
+                     return 1;
+                  }
                   stbi__jpeg_reset(z);
                }
             }
          }
+         stbi__idct_queue_flush(z, &q);
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
+         stbi__idct_queue q;
+         q.out[0] = q.out[1] = q.out[2] = q.out[3] = NULL;
          for (j=0; j < z->img_mcu_y; ++j) {
+            int j2 = j % z->mcu_rows;
+            if (z->stream && z->scan_n == z->s->img_n) {
+               // hand out the rows that no longer depend on undecoded data,
+               // before their part of the planes gets reused
+               stbi__idct_queue_flush(z, &q);
+               if (!stbi__jpeg_stream_rows(z, (j-1) * z->img_mcu_h)) return 0;
+               if (j >= z->roi_my1) {
+                  z->roi_done = 1;
+                  return 1;
+               }
+            }
             for (i=0; i < z->img_mcu_x; ++i) {
+               int skip = i < z->roi_mx0 || i >= z->roi_mx1 || j < z->roi_my0 || j >= z->roi_my1;
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
                   int n = z->order[k];
@@ -2954,11 +5969,12 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*z->img_comp[n].dct_w;
+                        int y2 = (j2*z->img_comp[n].v + y)*z->img_comp[n].dct_h;
                         int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        if (!stbi__jpeg_decode_block(z, stbi__idct_queue_slot(&q, n), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        if (!skip)
+                           stbi__idct_queue_push(z, &q, n, z->img_comp[n].data+z->img_comp[n].w2*y2+x2);
                      }
                   }
                }
@@ -2966,11 +5982,15 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                // so now count down the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) {
+                     stbi__idct_queue_flush(z, &q);
+                     return 1;
+                  }
                   stbi__jpeg_reset(z);
                }
             }
          }
+         stbi__idct_queue_flush(z, &q);
          return 1;
       }
    } else {
@@ -3043,22 +6063,45 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
+// dequantize and idct one row of blocks of a progressive image; task
+// indices run over the block rows of all components in turn
+static void stbi__jpeg_finish_row(void *user, int task)
+{
+   stbi__jpeg *z = (stbi__jpeg *) user;
+   int i, j = task, n = 0;
+   int w, h = (z->img_comp[0].y+7) >> 3;
+   while (j >= h) {
+      j -= h;
+      ++n;
+      h = (z->img_comp[n].y+7) >> 3;
+   }
+   if (j / z->img_comp[n].v < z->roi_my0 || j / z->img_comp[n].v >= z->roi_my1)
+      return;
+   w = (z->img_comp[n].x+7) >> 3;
+   if (w > z->roi_mx1 * z->img_comp[n].h)
+      w = z->roi_mx1 * z->img_comp[n].h;
+   for (i=z->roi_mx0 * z->img_comp[n].h; i < w; ++i) {
+      short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+      stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*z->img_comp[n].dct_h+i*z->img_comp[n].dct_w;
+      stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+      if (z->idct_block2_kernel && i+1 < w) {
+         // horizontally adjacent blocks are adjacent in coeff too
+         stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+         z->idct_block2_kernel(out, out+8, z->img_comp[n].w2, data);
+         ++i;
+      } else {
+         stbi__jpeg_idct(z, n, out, data);
+      }
+   }
+}
+
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
-      }
+      int n, rows = 0;
+      for (n=0; n < z->s->img_n; ++n)
+         rows += (z->img_comp[n].y+7) >> 3;
+      stbi__parallel_for(z->s->batch, stbi__jpeg_threads(z), rows, stbi__jpeg_finish_row, z);
    }
 }
 
@@ -3082,6 +6125,7 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
             int t = q & 15,i;
             if (p != 0 && p != 1) return stbi__err("bad DQT type","Corrupt JPEG");
             if (t > 3) return stbi__err("bad DQT table","Corrupt JPEG");
+            z->dqt_defined |= 1 << t;
 
             for (i=0; i < 64; ++i)
                z->dequant[t][stbi__jpeg_dezigzag[i]] = (stbi__uint16)(sixteen ? stbi__get16be(z->s) : stbi__get8(z->s));
@@ -3092,29 +6136,34 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
       case 0xC4: // DHT - define huffman table
          L = stbi__get16be(z->s)-2;
          while (L > 0) {
-            stbi_uc *v;
-            int sizes[16],i,n=0;
+            stbi_uc def[16+256];
+            stbi__huffman *h;
+            int sizes[16],i,k,n=0;
             int q = stbi__get8(z->s);
             int tc = q >> 4;
             int th = q & 15;
             if (tc > 1 || th > 3) return stbi__err("bad DHT header","Corrupt JPEG");
             for (i=0; i < 16; ++i) {
-               sizes[i] = stbi__get8(z->s);
+               def[i] = stbi__get8(z->s);
+               sizes[i] = def[i];
                n += sizes[i];
             }
-            L -= 17;
-            if (tc == 0) {
-               if (!stbi__build_huffman(z->huff_dc+th, sizes)) return 0;
-               v = z->huff_dc[th].values;
-            } else {
-               if (!stbi__build_huffman(z->huff_ac+th, sizes)) return 0;
-               v = z->huff_ac[th].values;
-            }
+            if (n > 256) return stbi__err("bad DHT header","Corrupt JPEG");
             for (i=0; i < n; ++i)
-               v[i] = stbi__get8(z->s);
+               def[16+i] = stbi__get8(z->s);
+            L -= 17 + n;
+            k = tc*4 + th;
+            z->dht_defined |= 1 << k;
+            if (z->dht_len[k] == 16+n && memcmp(z->dht[k], def, 16+n) == 0)
+               continue; // already built from the same definition
+            z->dht_len[k] = 0;
+            h = tc == 0 ? z->huff_dc+th : z->huff_ac+th;
+            if (!stbi__build_huffman(h, sizes)) return 0;
+            memcpy(h->values, def+16, n);
             if (tc != 0)
-               stbi__build_fast_ac(z->fast_ac[th], z->huff_ac + th);
-            L -= n;
+               stbi__build_fast_ac(z->fast_ac[th], h);
+            memcpy(z->dht[k], def, 16+n);
+            z->dht_len[k] = 16+n;
          }
          return L==0;
    }
@@ -3201,6 +6250,18 @@ static int stbi__process_scan_header(stbi__jpeg *z)
       }
    }
 
+   // the tables the scan decodes with must come from this image: a fresh
+   // stbi__jpeg has garbage in the others, a reused one the previous image's.
+   // progressive DC refinement reads raw bits, the other scans use one kind
+   // of Huffman table
+   for (i=0; i < z->scan_n; ++i) {
+      int dc = !z->progressive || (z->spec_start == 0 && z->succ_high == 0);
+      int ac = !z->progressive || z->spec_start != 0;
+      if (dc && !(z->dht_defined & (1 << z->img_comp[z->order[i]].hd))) return stbi__err("undefined huff","Corrupt JPEG");
+      if (ac && !(z->dht_defined & (1 << (4 + z->img_comp[z->order[i]].ha)))) return stbi__err("undefined huff","Corrupt JPEG");
+      if (!(z->dqt_defined & (1 << z->img_comp[z->order[i]].tq))) return stbi__err("undefined DQT","Corrupt JPEG");
+   }
+
    return 1;
 }
 
@@ -3209,23 +6270,50 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__scratch_free(z->s->scratch, z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__scratch_free(z->s->scratch, z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__scratch_free(z->s->scratch, z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
    return why;
 }
 
+// at a reduced scale, a subsampled plane gets a larger IDCT than the
+// full-size ones in the direction it's subsampled in, as far as that keeps
+// its upsampling factor whole: the chroma of a 4:2:0 image decoded at 1/8
+// comes out of a 2x2 IDCT at the size of the output, instead of 1x1 blocks
+// stretched over two pixels each, which smears colors across edges. this
+// is what libjpeg does too. ratio is h_max/h or v_max/v
+static int stbi__jpeg_comp_dct(stbi__jpeg *z, int ratio)
+{
+   int dct = z->dct_size, f = 2;
+   while (dct < 8 && ratio % f == 0) {
+      dct *= 2;
+      f *= 2;
+   }
+   return dct;
+}
+
+// how far the resamplers stretch plane n, horizontally and vertically
+static int stbi__jpeg_hs(stbi__jpeg *z, int n)
+{
+   return z->img_h_max * z->dct_size / (z->img_comp[n].h * z->img_comp[n].dct_w);
+}
+
+static int stbi__jpeg_vs(stbi__jpeg *z, int n)
+{
+   return z->img_v_max * z->dct_size / (z->img_comp[n].v * z->img_comp[n].dct_h);
+}
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
@@ -3283,6 +6371,16 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
+   // when streaming rows of a sequential image, a few MCU rows of each plane
+   // are enough: the one being decoded, the one being output, and the one
+   // above that for upsampling. see stbi__jpeg_stream_start
+   z->mcu_rows = z->img_mcu_y;
+   if (z->stream && !z->progressive && z->mcu_rows > 3)
+      z->mcu_rows = 3;
+   z->roi_mx0 = z->roi_my0 = 0;
+   z->roi_mx1 = z->img_mcu_x;
+   z->roi_my1 = z->img_mcu_y;
+
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
@@ -3294,23 +6392,29 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].dct_w = stbi__jpeg_comp_dct(z, h_max / z->img_comp[i].h);
+      z->img_comp[i].dct_h = stbi__jpeg_comp_dct(z, v_max / z->img_comp[i].v);
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->img_comp[i].dct_w;
+      z->img_comp[i].h2 = z->mcu_rows * z->img_comp[i].v * z->img_comp[i].dct_h;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      z->img_comp[i].raw_data = stbi__scratch_mad2(z->s->scratch, z->img_comp[i].w2, z->img_comp[i].h2, 15);
       if (z->img_comp[i].raw_data == NULL)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+      // a corrupt stream can end before every block is decoded; those stay
+      // black rather than showing what a recycled buffer held before
+      memset(z->img_comp[i].raw_data, 0, z->img_comp[i].w2 * z->img_comp[i].h2 + 15);
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // w2, h2 are multiples of dct_w, dct_h (see above)
+         z->img_comp[i].coeff_w = z->img_comp[i].w2 / z->img_comp[i].dct_w;
+         z->img_comp[i].coeff_h = z->img_comp[i].h2 / z->img_comp[i].dct_h;
+         z->img_comp[i].raw_coeff = stbi__scratch_mad3(z->s->scratch, z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+         memset(z->img_comp[i].raw_coeff, 0, z->img_comp[i].coeff_w * 8 * z->img_comp[i].coeff_h * 8 * sizeof(short) + 15);
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
       }
    }
@@ -3332,6 +6436,8 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
    int m;
    z->jfif = 0;
    z->app14_color_transform = -1; // valid values are 0,1,2
+   z->dht_defined = 0;
+   z->dqt_defined = 0;
    z->marker = STBI__MARKER_none; // initialize cached marker to empty
    m = stbi__get_marker(z);
    if (!stbi__SOI(m)) return stbi__err("no SOI","Corrupt JPEG");
@@ -3351,6 +6457,8 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
    return 1;
 }
 
+static int stbi__jpeg_stream_start(stbi__jpeg *z);
+
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
@@ -3365,7 +6473,9 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
+         if (j->stream && !stbi__jpeg_stream_start(j)) return 0;
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (j->roi_done) return 1;
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -3763,18 +6873,155 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_SSE2
+// value of output sample p of stbi__resample_row_hv_2(in_near, in_far, w)
+static stbi_uc stbi__hv_2_sample(stbi_uc const *in_near, stbi_uc const *in_far, int w, int p)
+{
+   int m = p >> 1;
+   int t = 3*in_near[m] + in_far[m];
+   if (p & 1) {
+      if (m+1 >= w) return stbi__div4(t+2);
+      return stbi__div16(3*t + 3*in_near[m+1] + in_far[m+1] + 8);
+   } else {
+      if (m == 0) return stbi__div4(t+2);
+      return stbi__div16(3*t + 3*in_near[m-1] + in_far[m-1] + 8);
+   }
+}
+
+// stbi__resample_row_hv_2 on the chroma rows followed by
+// stbi__YCbCr_to_RGB_simd, without the intermediate chroma rows; the
+// upsampled chroma goes straight from the filter into the color transform.
+// produces the same bytes as the two separate passes, including the byte
+// past the end of the row for step 3. w is the chroma width, count the
+// number of output pixels (at most 2*w).
+static void stbi__YCbCr_hv_2_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int count, int step)
+{
+   int i = 0, p;
+
+   __m128i zero      = _mm_setzero_si128();
+   __m128i bias8     = _mm_set1_epi16(8);
+   __m128i c128      = _mm_set1_epi16(128);
+   __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m128i y_bias    = _mm_set1_epi8((char) (unsigned char) 128);
+   __m128i xw        = _mm_set1_epi16(255); // alpha channel
+
+   // 2x upsample 8 chroma samples to 16, as 16-bit values in lo/hi;
+   // see stbi__resample_row_hv_2_simd for how the filter works
+   #define hv2_filter(lo, hi, in_near, in_far) \
+      { \
+         __m128i farw  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) (in_far + i)), zero); \
+         __m128i nearw = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) (in_near + i)), zero); \
+         __m128i curr  = _mm_add_epi16(_mm_slli_epi16(nearw, 2), _mm_sub_epi16(farw, nearw)); \
+         int tp = i ? 3*in_near[i-1] + in_far[i-1] : 3*in_near[0] + in_far[0]; \
+         __m128i prev  = _mm_insert_epi16(_mm_slli_si128(curr, 2), tp, 0); \
+         __m128i next  = _mm_insert_epi16(_mm_srli_si128(curr, 2), 3*in_near[i+8] + in_far[i+8], 7); \
+         __m128i curb  = _mm_add_epi16(_mm_slli_epi16(curr, 2), bias8); \
+         __m128i even  = _mm_add_epi16(_mm_sub_epi16(prev, curr), curb); \
+         __m128i odd   = _mm_add_epi16(_mm_sub_epi16(next, curr), curb); \
+         lo = _mm_srli_epi16(_mm_unpacklo_epi16(even, odd), 4); \
+         hi = _mm_srli_epi16(_mm_unpackhi_epi16(even, odd), 4); \
+      }
+
+   // color transform of 8 pixels, see stbi__YCbCr_to_RGB_simd
+   #define ycc_convert8(dst, yp, cb16, cr16) \
+      { \
+         __m128i yw  = _mm_unpacklo_epi8(y_bias, _mm_loadl_epi64((__m128i *) (yp))); \
+         __m128i crw = _mm_slli_epi16(_mm_sub_epi16(cr16, c128), 8); \
+         __m128i cbw = _mm_slli_epi16(_mm_sub_epi16(cb16, c128), 8); \
+         __m128i yws = _mm_srli_epi16(yw, 4); \
+         __m128i rws = _mm_add_epi16(_mm_mulhi_epi16(cr_const0, crw), yws); \
+         __m128i gwt = _mm_add_epi16(_mm_mulhi_epi16(cb_const0, cbw), yws); \
+         __m128i bws = _mm_add_epi16(yws, _mm_mulhi_epi16(cbw, cb_const1)); \
+         __m128i gws = _mm_add_epi16(gwt, _mm_mulhi_epi16(crw, cr_const1)); \
+         __m128i brb = _mm_packus_epi16(_mm_srai_epi16(rws, 4), _mm_srai_epi16(bws, 4)); \
+         __m128i gxb = _mm_packus_epi16(_mm_srai_epi16(gws, 4), xw); \
+         __m128i t0  = _mm_unpacklo_epi8(brb, gxb); \
+         __m128i t1  = _mm_unpackhi_epi8(brb, gxb); \
+         __m128i o0  = _mm_unpacklo_epi16(t0, t1); \
+         __m128i o1  = _mm_unpackhi_epi16(t0, t1); \
+         if (step == 4) { \
+            _mm_storeu_si128((__m128i *) (dst + 0), o0); \
+            _mm_storeu_si128((__m128i *) (dst + 16), o1); \
+         } else { \
+            /* overlapping 4-byte stores in pixel order, so each alpha */ \
+            /* byte is overwritten by the next pixel */ \
+            int q; \
+            for (q=0; q < 8; ++q) { \
+               stbi__uint32 v = (stbi__uint32) _mm_cvtsi128_si32(o0); \
+               memcpy(dst + 3*q, &v, 4); \
+               o0 = _mm_srli_si128(o0, 4); \
+               if (q == 3) o0 = o1; \
+            } \
+         } \
+      }
+
+   // groups of 8 chroma samples; the filter needs the sample after the
+   // group, so the last one is always left to the scalar loop
+   for (; i < ((w-1) & ~7) && i*2+16 <= count; i += 8) {
+      __m128i cb_lo, cb_hi, cr_lo, cr_hi;
+      hv2_filter(cb_lo, cb_hi, cb_near, cb_far);
+      hv2_filter(cr_lo, cr_hi, cr_near, cr_far);
+      ycc_convert8(out + i*2*step, y + i*2, cb_lo, cr_lo);
+      ycc_convert8(out + (i*2+8)*step, y + i*2 + 8, cb_hi, cr_hi);
+   }
+
+   #undef hv2_filter
+   #undef ycc_convert8
+
+   for (p = i*2; p < count; ++p) {
+      stbi_uc *o = out + p*step;
+      int y_fixed = (y[p] << 20) + (1<<19); // rounding
+      int r,g,b;
+      int cr = stbi__hv_2_sample(cr_near, cr_far, w, p) - 128;
+      int cb = stbi__hv_2_sample(cb_near, cb_far, w, p) - 128;
+      r = y_fixed +  cr* stbi__float2fixed(1.40200f);
+      g = y_fixed + (cr*-stbi__float2fixed(0.71414f)) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
+      b = y_fixed                                     +   cb* stbi__float2fixed(1.77200f);
+      r >>= 20;
+      g >>= 20;
+      b >>= 20;
+      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+      o[0] = (stbi_uc)r;
+      o[1] = (stbi_uc)g;
+      o[2] = (stbi_uc)b;
+      o[3] = 255;
+   }
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_block2_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+   j->YCbCr_hv_2_to_RGB_kernel = NULL;
+   j->dct_size = 8;
+   j->stream = NULL;
+   j->roi_done = 0;
 
 #ifdef STBI_SSE2
-   if (stbi__sse2_available()) {
+   if (j->simd < 0) {
+      j->simd = stbi__sse2_available();
+#ifdef STBI_AVX2
+      if (j->simd && stbi__avx2_available()) j->simd = 2;
+#endif
+   }
+   if (j->simd) {
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+      j->YCbCr_hv_2_to_RGB_kernel = stbi__YCbCr_hv_2_to_RGB_simd;
+#ifdef STBI_AVX2
+      if (j->simd == 2)
+         j->idct_block2_kernel = stbi__idct2_avx2;
+#endif
    }
 #endif
 
@@ -3808,9 +7055,222 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+static void stbi__jpeg_resample_init(stbi__jpeg *z, stbi__resample *r, int k)
+{
+   r->hs      = stbi__jpeg_hs(z, k);
+   r->vs      = stbi__jpeg_vs(z, k);
+   r->ystep   = r->vs >> 1;
+   r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+   r->ypos    = 0;
+   r->line0   = r->line1 = z->img_comp[k].data;
+
+   if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+   else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+   else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+   else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+   else                               r->resample = stbi__resample_row_generic;
+}
+
+// move on to the next output row
+static void stbi__jpeg_resample_advance(stbi__jpeg *z, stbi__resample *r, int k)
+{
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < z->img_comp[k].y) {
+         r->line1 += z->img_comp[k].w2;
+         if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+            r->line1 = z->img_comp[k].data; // planes are a ring of MCU rows
+      }
+   }
+}
+
+typedef struct
 {
+   stbi__jpeg *z;
+   stbi_uc *output;
    int n, decode_n, is_rgb;
+   int fused;         // use YCbCr_hv_2_to_RGB_kernel
+   int band_h;        // output rows per band
+   stbi_uc *scratch;  // one row per band, see below
+   int x0, x1;        // columns to output; x0 is a multiple of the MCU width
+   int flip;          // store the rows bottom-up
+} stbi__jpeg_convert;
+
+// resample and color-convert the next output row
+static void stbi__jpeg_convert_row(stbi__jpeg_convert *job, stbi__resample *res_comp, stbi_uc **linebuf, stbi_uc *out)
+{
+   stbi__jpeg *z = job->z;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *cnear[4], *cfar[4];
+   unsigned int i, w = job->x1 - job->x0;
+   int k;
+
+   for (k=0; k < job->decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      int y_bot = r->ystep >= (r->vs >> 1);
+      int x0 = job->x0 / r->hs;
+      cnear[k] = (y_bot ? r->line1 : r->line0) + x0;
+      cfar[k]  = (y_bot ? r->line0 : r->line1) + x0;
+      if (!job->fused || k == 0)
+         coutput[k] = r->resample(linebuf[k], cnear[k], cfar[k], r->w_lores - x0, r->hs);
+      stbi__jpeg_resample_advance(z, r, k);
+   }
+   if (job->fused) {
+      z->YCbCr_hv_2_to_RGB_kernel(out, coutput[0], cnear[1], cfar[1], cnear[2], cfar[2], res_comp[1].w_lores - job->x0 / 2, w, job->n);
+   } else if (job->n >= 3) {
+      stbi_uc *y = coutput[0];
+      if (z->s->img_n == 3) {
+         if (job->is_rgb) {
+            for (i=0; i < w; ++i) {
+               out[0] = y[i];
+               out[1] = coutput[1][i];
+               out[2] = coutput[2][i];
+               out[3] = 255;
+               out += job->n;
+            }
+         } else {
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, job->n);
+         }
+      } else if (z->s->img_n == 4) {
+         if (z->app14_color_transform == 0) { // CMYK
+            for (i=0; i < w; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(coutput[0][i], m);
+               out[1] = stbi__blinn_8x8(coutput[1][i], m);
+               out[2] = stbi__blinn_8x8(coutput[2][i], m);
+               out[3] = 255;
+               out += job->n;
+            }
+         } else if (z->app14_color_transform == 2) { // YCCK
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, job->n);
+            for (i=0; i < w; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(255 - out[0], m);
+               out[1] = stbi__blinn_8x8(255 - out[1], m);
+               out[2] = stbi__blinn_8x8(255 - out[2], m);
+               out += job->n;
+            }
+         } else { // YCbCr + alpha?  Ignore the fourth channel for now
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, job->n);
+         }
+      } else
+         for (i=0; i < w; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            out[3] = 255; // not used if n==3
+            out += job->n;
+         }
+   } else {
+      if (job->is_rgb) {
+         if (job->n == 1)
+            for (i=0; i < w; ++i)
+               *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+         else {
+            for (i=0; i < w; ++i, out += 2) {
+               out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+               out[1] = 255;
+            }
+         }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+         for (i=0; i < w; ++i) {
+            stbi_uc m = coutput[3][i];
+            stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+            stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+            stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+            out[0] = stbi__compute_y(r, g, b);
+            out[1] = 255;
+            out += job->n;
+         }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+         for (i=0; i < w; ++i) {
+            out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            out[1] = 255;
+            out += job->n;
+         }
+      } else {
+         stbi_uc *y = coutput[0];
+         if (job->n == 1)
+            for (i=0; i < w; ++i) out[i] = y[i];
+         else
+            for (i=0; i < w; ++i) { *out++ = y[i]; *out++ = 255; }
+      }
+   }
+}
+
+// resample and color-convert one band of output rows. every band has its
+// own slice of the component line buffers, so bands can run concurrently
+static void stbi__jpeg_convert_band(void *user, int band)
+{
+   stbi__jpeg_convert *job = (stbi__jpeg_convert *) user;
+   stbi__jpeg *z = job->z;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4];
+   unsigned int j, w = z->s->img_x;
+   unsigned int y0 = band * job->band_h, y1 = y0 + job->band_h;
+   int k;
+
+   if (y1 > z->s->img_y) y1 = z->s->img_y;
+   for (k=0; k < job->decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      stbi__jpeg_resample_init(z, r, k);
+      for (j=0; j < y0; ++j)
+         stbi__jpeg_resample_advance(z, r, k);
+      linebuf[k] = z->img_comp[k].linebuf + band * (w + 3);
+   }
+
+   for (j=y0; j < y1; ++j) {
+      stbi_uc *row = job->output + job->n * w * (job->flip ? z->s->img_y-1 - j : j), *out = row;
+      // the 3-channel converters write a byte past the end of the row, onto
+      // the next row in memory. top-down, that row gets written afterwards;
+      // bottom-up, it was written just before, so that byte is put back. the
+      // row whose neighbour belongs to another band, which may already have
+      // written or still be writing it, goes via scratch
+      int edge = job->flip ? j == y0 && y0 > 0 : j+1 == y1 && y1 < z->s->img_y;
+      stbi_uc keep = 0;
+      if (edge)
+         out = job->scratch + band * (job->n * w + 1);
+      else if (job->flip && j > y0)
+         keep = row[job->n * w];
+      stbi__jpeg_convert_row(job, res_comp, linebuf, out);
+      if (edge)
+         memcpy(row, out, job->n * w);
+      else if (job->flip && j > y0)
+         row[job->n * w] = keep;
+   }
+}
+
+// pick the output format; returns 0 if there is nothing to output
+static int stbi__jpeg_convert_init(stbi__jpeg *z, stbi__jpeg_convert *job, int req_comp)
+{
+   // determine actual number of components to generate
+   job->z = z;
+   job->n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+
+   job->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+
+   if (z->s->img_n == 3 && job->n < 3 && !job->is_rgb)
+      job->decode_n = 1;
+   else
+      job->decode_n = z->s->img_n;
+
+   // 4:2:0 YCbCr to RGB(A) can upsample and convert in one pass
+   job->fused = z->YCbCr_hv_2_to_RGB_kernel && z->s->img_n == 3 && job->n >= 3 && !job->is_rgb
+             && stbi__jpeg_hs(z, 0) == 1 && stbi__jpeg_vs(z, 0) == 1
+             && stbi__jpeg_hs(z, 1) == 2 && stbi__jpeg_hs(z, 2) == 2
+             && stbi__jpeg_vs(z, 1) == 2 && stbi__jpeg_vs(z, 2) == 2;
+   job->output = NULL;
+   job->scratch = NULL;
+   job->band_h = 0;
+   job->x0 = 0;
+   job->x1 = z->s->img_x;
+   job->flip = 0;
+   return job->decode_n > 0;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   int n;
+   stbi__jpeg_convert job;
    z->s->img_n = 0; // make stbi__cleanup_jpeg safe
 
    // validate req_comp
@@ -3819,150 +7279,58 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
-
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
-
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
+   if (z->dct_size < 8) {
+      // decoded at reduced scale; from here on all sizes are the reduced ones
+      z->s->img_x = (z->s->img_x * z->dct_size + 7) >> 3;
+      z->s->img_y = (z->s->img_y * z->dct_size + 7) >> 3;
+      for (n=0; n < z->s->img_n; ++n) {
+         z->img_comp[n].x = (z->img_comp[n].x * z->img_comp[n].dct_w + 7) >> 3;
+         z->img_comp[n].y = (z->img_comp[n].y * z->img_comp[n].dct_h + 7) >> 3;
+      }
+   }
 
    // nothing to do if no components requested; check this now to avoid
    // accessing uninitialized coutput[0] later
-   if (decode_n <= 0) { stbi__cleanup_jpeg(z); return NULL; }
+   if (!stbi__jpeg_convert_init(z, &job, req_comp)) { stbi__cleanup_jpeg(z); return NULL; }
+   n = job.n;
 
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
       stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
+      int bands = 1, threads = stbi__jpeg_threads(z);
+
+      // bands of at least 16 rows, so that the cost of starting each one
+      // (stepping the resamplers to its first row) stays negligible
+      if (threads > 1) {
+         bands = (int) (z->s->img_y / 16);
+         if (bands > threads) bands = threads;
+         if (bands < 1) bands = 1;
+      }
 
+      for (k=0; k < job.decode_n; ++k) {
          // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+         // with upsample factor of 4, one for each band
+         z->img_comp[k].linebuf = (stbi_uc *) stbi__scratch_mad2(z->s->scratch, bands, z->s->img_x + 3, 0);
          if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      }
 
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
+      if (bands > 1) {
+         job.scratch = (stbi_uc *) stbi__scratch_mad3(z->s->scratch, bands, n, z->s->img_x, bands);
+         if (!job.scratch) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
       }
 
       // can't error after this so, this is safe
       output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      if (!output) { stbi__scratch_free(z->s->scratch, job.scratch); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
-      }
+      job.output = output;
+      job.flip = z->s->flip;
+      job.band_h = (z->s->img_y + bands - 1) / bands;
+      stbi__parallel_for(z->s->batch, threads, bands, stbi__jpeg_convert_band, &job);
+      stbi__scratch_free(z->s->scratch, job.scratch);
+
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
@@ -3971,29 +7339,237 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    }
 }
 
+// first and one-past-last MCU to reconstruct for pixels lo..hi-1
+static int stbi__jpeg_roi_lo(int lo, int mcu)
+{
+   return lo / mcu > 0 ? lo / mcu - 1 : 0;
+}
+
+static int stbi__jpeg_roi_hi(int hi, int mcu, int count)
+{
+   return (hi-1) / mcu + 2 < count ? (hi-1) / mcu + 2 : count;
+}
+
+// stbi_load_rows: output rows are converted and handed out a batch (one MCU
+// row) at a time, as soon as everything the upsampler needs for them has
+// been decoded
+typedef struct
+{
+   stbi__jpeg_convert job;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4];
+   stbi_uc *rows;   // one batch of output rows
+   int next_y;      // first row not handed out yet
+   int req_comp;
+   int started;
+} stbi__jpeg_stream;
+
+// called at every SOS; sets up the output once the first scan starts
+static int stbi__jpeg_stream_start(stbi__jpeg *z)
+{
+   stbi__jpeg_stream *js = (stbi__jpeg_stream *) z->stream;
+   stbi__stream *st = z->s->stream;
+   int k;
+
+   if (js->started) return 1;
+   js->started = 1;
+
+   if (z->mcu_rows < z->img_mcu_y && z->scan_n != z->s->img_n) {
+      // components come in separate scans, so we need the whole planes after all
+      for (k=0; k < z->s->img_n; ++k) {
+         stbi__scratch_free(z->s->scratch, z->img_comp[k].raw_data);
+         z->img_comp[k].h2 = z->img_mcu_y * z->img_comp[k].v * z->img_comp[k].dct_h;
+         z->img_comp[k].raw_data = stbi__scratch_mad2(z->s->scratch, z->img_comp[k].w2, z->img_comp[k].h2, 15);
+         if (z->img_comp[k].raw_data == NULL) return stbi__err("outofmem", "Out of memory");
+         memset(z->img_comp[k].raw_data, 0, z->img_comp[k].w2 * z->img_comp[k].h2 + 15);
+         z->img_comp[k].data = (stbi_uc*) (((size_t) z->img_comp[k].raw_data + 15) & ~15);
+      }
+      z->mcu_rows = z->img_mcu_y;
+   }
+
+   if (!stbi__jpeg_convert_init(z, &js->job, js->req_comp)) return 0;
+   if (!stbi__stream_begin(st, z->s->img_x, z->s->img_y, z->s->img_n >= 3 ? 3 : 1, js->job.n)) return 0;
+
+   // only reconstruct the MCUs the region touches, plus one all around
+   // for the upsampling filters; the edge handling of the resamplers then
+   // only affects columns and rows that aren't handed out
+   z->roi_mx0 = stbi__jpeg_roi_lo(st->x0, z->img_mcu_w);
+   z->roi_my0 = stbi__jpeg_roi_lo(st->y0, z->img_mcu_h);
+   z->roi_mx1 = stbi__jpeg_roi_hi(st->x1, z->img_mcu_w, z->img_mcu_x);
+   z->roi_my1 = stbi__jpeg_roi_hi(st->y1, z->img_mcu_h, z->img_mcu_y);
+   js->job.x0 = z->roi_mx0 * z->img_mcu_w;
+   if (z->roi_mx1 < z->img_mcu_x)
+      js->job.x1 = z->roi_mx1 * z->img_mcu_w;
+   st->row_x = js->job.x0;
+   st->row_bytes = js->job.n * (js->job.x1 - js->job.x0);
+   st->direct = 1;
+   st->overrun = js->job.n == 3;
+
+   for (k=0; k < js->job.decode_n; ++k) {
+      stbi__resample *r = &js->res_comp[k];
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__scratch_malloc(z->s->scratch, z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+      js->linebuf[k] = z->img_comp[k].linebuf;
+      stbi__jpeg_resample_init(z, r, k);
+      r->w_lores = (js->job.x1 + r->hs-1) / r->hs;
+   }
+   // the 3-channel converters write a byte past the end of the row
+   js->rows = (stbi_uc *) stbi__scratch_mad3(z->s->scratch, js->job.n, z->s->img_x, z->img_mcu_h, 1);
+   if (!js->rows) return stbi__err("outofmem", "Out of memory");
+   return 1;
+}
+
+// convert and hand out the rows before y1
+static int stbi__jpeg_stream_rows(stbi__jpeg *z, int y1)
+{
+   stbi__jpeg_stream *js = (stbi__jpeg_stream *) z->stream;
+   stbi__stream *st = z->s->stream;
+   int k, count, stride = st->row_bytes;
+
+   if (y1 > st->y1) y1 = st->y1;
+   // rows above the region are only stepped over
+   for (; js->next_y < y1 && js->next_y < st->y0; ++js->next_y)
+      for (k=0; k < js->job.decode_n; ++k)
+         stbi__jpeg_resample_advance(z, &js->res_comp[k], k);
+   while (js->next_y < y1) {
+      count = y1 - js->next_y;
+      if (count > z->img_mcu_h) count = z->img_mcu_h;
+      for (k=0; k < count; ++k) {
+         stbi_uc *out = stbi__stream_direct(st, js->next_y + k);
+         stbi__jpeg_convert_row(&js->job, js->res_comp, js->linebuf, out ? out : js->rows + k * stride);
+      }
+      if (!stbi__stream_rows(z->s->stream, js->next_y, count, js->rows)) return 0;
+      js->next_y += count;
+   }
+   return 1;
+}
+
+static int stbi__jpeg_stream_image(stbi__jpeg *z, int req_comp)
+{
+   stbi__jpeg_stream js;
+   int result;
+
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   js.rows = NULL;
+   js.next_y = 0;
+   js.req_comp = req_comp;
+   js.started = 0;
+   z->stream = &js;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   result = stbi__decode_jpeg_image(z);
+   if (result && !js.started)
+      result = stbi__err("no SOS", "Corrupt JPEG");
+   // whatever wasn't handed out during decoding: the last MCU row, or all
+   // of a progressive image
+   if (result)
+      result = stbi__jpeg_stream_rows(z, z->s->img_y);
+
+   stbi__scratch_free(z->s->scratch, js.rows);
+   stbi__cleanup_jpeg(z);
+   z->stream = NULL;
+   return result;
+}
+
+// the decoder for a load from s: the one its stbi_decoder keeps, with the
+// tables of the previous image, or a new one
+static stbi__jpeg *stbi__jpeg_acquire(stbi__context *s)
+{
+   stbi__jpeg *j = s->dec ? (stbi__jpeg *) s->dec->jpeg : NULL;
+   if (!j) {
+      j = (stbi__jpeg *) (s->dec ? stbi__malloc(sizeof(stbi__jpeg)) : stbi__scratch_malloc(s->scratch, sizeof(stbi__jpeg)));
+      if (!j) return NULL;
+      memset(j->dht_len, 0, sizeof(j->dht_len));
+      j->simd = -1;
+      if (s->dec) s->dec->jpeg = j;
+   }
+   j->s = s;
+   return j;
+}
+
+static void stbi__jpeg_release(stbi__jpeg *j)
+{
+   if (!j->s->dec) stbi__scratch_free(j->s->scratch, j);
+}
+
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
-   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__jpeg* j = stbi__jpeg_acquire(s);
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
-   STBI_NOTUSED(ri);
-   j->s = s;
+   ri->flipped = s->flip;
    stbi__setup_jpeg(j);
-   result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   if (s->jpeg_scale > 1) {
+      // only the top-left dct_w x dct_h coefficients of each block
+      // contribute; stbi__process_frame_header picks the sizes for each plane
+      j->dct_size = 8 / s->jpeg_scale;
+      j->idct_block2_kernel = NULL;
+   }
+   if (s->stream) {
+      s->stream->done = stbi__jpeg_stream_image(j, req_comp);
+      result = NULL;
+   } else
+      result = load_jpeg_image(j, x,y,comp,req_comp);
+   stbi__jpeg_release(j);
+   return result;
+}
+
+static stbi_uc *stbi__jpeg_load_ycbcr(stbi__context *s, int *x, int *y, stbi_planes *planes)
+{
+   stbi_uc *result = NULL;
+   stbi__jpeg* z = stbi__jpeg_acquire(s);
+   if (!z) return stbi__errpuc("outofmem", "Out of memory");
+   stbi__setup_jpeg(z);
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (stbi__decode_jpeg_image(z)) {
+      int is_rgb = s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+      if (s->img_n == 2 || s->img_n == 4 || is_rgb) {
+         result = stbi__errpuc("not YCbCr", "Only YCbCr and grayscale JPEGs have planes");
+      } else {
+         size_t total = 0;
+         int k, j;
+         planes->num_planes = s->img_n;
+         for (k=0; k < s->img_n; ++k) {
+            planes->w[k] = z->img_comp[k].x;
+            planes->h[k] = z->img_comp[k].y;
+            total += (size_t) planes->w[k] * planes->h[k];
+         }
+         result = (stbi_uc *) stbi__malloc(total);
+         if (!result) {
+            result = stbi__errpuc("outofmem", "Out of memory");
+         } else {
+            stbi_uc *p = result;
+            for (k=0; k < s->img_n; ++k) {
+               planes->plane[k] = p;
+               for (j=0; j < planes->h[k]; ++j) {
+                  int row = s->opt.flip_vertically ? planes->h[k]-1 - j : j;
+                  memcpy(p + (size_t) row * planes->w[k], z->img_comp[k].data + (size_t) j * z->img_comp[k].w2, planes->w[k]);
+               }
+               p += (size_t) planes->w[k] * planes->h[k];
+            }
+            for (; k < 3; ++k) {
+               planes->plane[k] = NULL;
+               planes->w[k] = planes->h[k] = 0;
+            }
+            *x = s->img_x;
+            *y = s->img_y;
+         }
+      }
+   }
+   stbi__cleanup_jpeg(z);
+   stbi__jpeg_release(z);
    return result;
 }
 
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
-   stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+   stbi__jpeg* j = stbi__jpeg_acquire(s);
    if (!j) return stbi__err("outofmem", "Out of memory");
-   j->s = s;
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__jpeg_release(j);
    return r;
 }
 
@@ -4012,11 +7588,10 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
 static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 {
    int result;
-   stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
+   stbi__jpeg* j = stbi__jpeg_acquire(s);
    if (!j) return stbi__err("outofmem", "Out of memory");
-   j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__jpeg_release(j);
    return result;
 }
 #endif
@@ -4031,20 +7606,41 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, and nearly all in practice
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+// a table entry holds everything needed to act on a code, so a length or
+// distance comes out of one lookup together with the width of its extra bits:
+//    bits  0..4   code length + extra bits, i.e. bits to consume
+//    bits  5..8   code length
+//    bits  9..10  kind
+//    bits 16..31  literal/symbol, or length/distance base
+#define STBI__ZE_TOTAL(e)   ((int) ((e) & 31))
+#define STBI__ZE_CODE(e)    ((int) (((e) >> 5) & 15))
+#define STBI__ZE_KIND(e)    ((int) (((e) >> 9) & 3))
+#define STBI__ZE_VALUE(e)   ((int) ((e) >> 16))
+
+#define STBI__ZK_VALUE  0 // literal, or plain symbol
+#define STBI__ZK_BASE   1 // length or distance base plus extra bits
+#define STBI__ZK_EOB    2 // end of block
+#define STBI__ZK_BAD    3 // symbol that may not appear in a valid stream
+
+// alphabets, which decide how symbols turn into entries
+#define STBI__ZA_PLAIN   0 // code length code
+#define STBI__ZA_LITLEN  1
+#define STBI__ZA_DIST    2
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   stbi__uint16 fast[1 << STBI__ZFAST_BITS];
+   stbi__uint32 fast[1 << STBI__ZFAST_BITS];
    stbi__uint16 firstcode[16];
    int maxcode[17];
    stbi__uint16 firstsymbol[16];
    stbi_uc  size[STBI__ZNSYMS];
-   stbi__uint16 value[STBI__ZNSYMS];
+   stbi__uint32 value[STBI__ZNSYMS];
 } stbi__zhuffman;
 
 stbi_inline static int stbi__bitreverse16(int n)
@@ -4064,7 +7660,48 @@ stbi_inline static int stbi__bit_reverse(int v, int bits)
    return stbi__bitreverse16(v) >> (16-bits);
 }
 
-static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num)
+static const int stbi__zlength_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int stbi__zlength_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static stbi__uint32 stbi__zentry(int sym, int s, int alphabet)
+{
+   int kind = STBI__ZK_VALUE, value = sym, extra = 0;
+   if (alphabet == STBI__ZA_LITLEN && sym >= 256) {
+      value = 0;
+      if (sym == 256) {
+         kind = STBI__ZK_EOB;
+      } else if (sym < 286) {
+         kind  = STBI__ZK_BASE;
+         value = stbi__zlength_base[sym-257];
+         extra = stbi__zlength_extra[sym-257];
+      } else {
+         kind = STBI__ZK_BAD;
+      }
+   } else if (alphabet == STBI__ZA_DIST) {
+      value = 0;
+      if (sym < 30) {
+         kind  = STBI__ZK_BASE;
+         value = stbi__zdist_base[sym];
+         extra = stbi__zdist_extra[sym];
+      } else {
+         kind = STBI__ZK_BAD;
+      }
+   }
+   return ((stbi__uint32) value << 16) | (kind << 9) | (s << 5) | (s + extra);
+}
+
+static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num, int alphabet)
 {
    int i,k=0;
    int code, next_code[16], sizes[17];
@@ -4095,13 +7732,13 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
       int s = sizelist[i];
       if (s) {
          int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
-         stbi__uint16 fastv = (stbi__uint16) ((s << 9) | i);
-         z->size [c] = (stbi_uc     ) s;
-         z->value[c] = (stbi__uint16) i;
+         stbi__uint32 entry = stbi__zentry(i, s, alphabet);
+         z->size [c] = (stbi_uc) s;
+         z->value[c] = entry;
          if (s <= STBI__ZFAST_BITS) {
             int j = stbi__bit_reverse(next_code[s],s);
             while (j < (1 << STBI__ZFAST_BITS)) {
-               z->fast[j] = fastv;
+               z->fast[j] = entry;
                j += (1 << s);
             }
          }
@@ -4111,6 +7748,20 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
    return 1;
 }
 
+// Huffman tables a stbi_decoder keeps between zlib streams: the fixed ones,
+// and the last dynamic ones with the code lengths they were built from
+typedef struct
+{
+   stbi__zhuffman fixed_length, fixed_distance;
+   int have_fixed;
+   stbi__zhuffman length, distance;
+   stbi_uc lencodes[286+32];
+   int hlit, hdist; // 0 if length and distance aren't valid
+   stbi__zhuffman codelength;
+   stbi_uc codelength_sizes[19];
+   int have_codelength;
+} stbi__zcache;
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
@@ -4121,14 +7772,26 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   stbi__uint64 code_buffer; // only ever holds whole bytes read from zbuffer
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
 
-   stbi__zhuffman z_length, z_distance;
+   // window mode: output older than 32K is handed to flush instead of growing the buffer
+   int (*flush)(void *user, stbi_uc *data, int len);
+   void *flush_user;
+
+   // bounded mode: output goes straight into dest and is never grown; once
+   // dest is full the rest of the stream goes through a scratch window (spill)
+   // so it is still checked, and only what fits in dest is kept
+   char *dest, *spill;
+   int dest_len, dest_pos;
+
+   stbi__zhuffman *z_length, *z_distance; // the tables in use: z_tables, or ones in cache
+   stbi__zhuffman z_tables[2];
+   stbi__zcache *cache; // tables kept from earlier streams, or NULL
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
@@ -4136,69 +7799,111 @@ stbi_inline static int stbi__zeof(stbi__zbuf *z)
    return (z->zbuffer >= z->zbuffer_end);
 }
 
-stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
+stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
+{
+   return stbi__zeof(z) ? 0 : *z->zbuffer++;
+}
+
+// little-endian 64-bit load; compilers fold this into a single load where they can
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
 {
-   return stbi__zeof(z) ? 0 : *z->zbuffer++;
+   stbi__uint32 lo = p[0] | (p[1] << 8) | (p[2] << 16) | ((stbi__uint32) p[3] << 24);
+   stbi__uint32 hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((stbi__uint32) p[7] << 24);
+   return ((stbi__uint64) hi << 32) | lo;
 }
 
 static void stbi__fill_bits(stbi__zbuf *z)
 {
-   do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
-        z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
-        return;
-      }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+   // at the end of the input the buffer just stays short; callers check
+   while (z->num_bits <= 56 && !stbi__zeof(z)) {
+      z->code_buffer |= (stbi__uint64) *z->zbuffer++ << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   }
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
+   if (z->num_bits < n) {
+      // out of data: read zeros, and let the caller trip over them
+      z->code_buffer = 0;
+      z->num_bits = 0;
+      return k;
+   }
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+static stbi__uint32 stbi__zhuffman_decode_slowpath(stbi__zhuffman *z, stbi__uint64 code_buffer)
 {
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
-   if (s >= 16) return -1; // invalid code!
+   if (s >= 16) return 0; // invalid code!
    // code size is s, so:
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
-   if (b >= STBI__ZNSYMS) return -1; // some data was corrupt somewhere!
-   if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
-   a->code_buffer >>= s;
-   a->num_bits -= s;
+   if (b >= STBI__ZNSYMS) return 0; // some data was corrupt somewhere!
+   if (z->size[b] != s) return 0;  // was originally an assert, but report failure instead.
    return z->value[b];
 }
 
+// entry for the code at the bottom of code_buffer, 0 if there is none
+stbi_inline static stbi__uint32 stbi__zhuffman_lookup(stbi__zhuffman *z, stbi__uint64 code_buffer)
+{
+   stbi__uint32 e = z->fast[code_buffer & STBI__ZFAST_MASK];
+   return e ? e : stbi__zhuffman_decode_slowpath(z, code_buffer);
+}
+
+// decode one plain symbol, or -1
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
-   int b,s;
-   if (a->num_bits < 16) {
-      if (stbi__zeof(a)) {
-         return -1;   /* report error for unexpected end of data. */
-      }
-      stbi__fill_bits(a);
-   }
-   b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
-   if (b) {
-      s = b >> 9;
-      a->code_buffer >>= s;
-      a->num_bits -= s;
-      return b & 511;
+   stbi__uint32 e;
+   if (a->num_bits < 16) stbi__fill_bits(a);
+   e = stbi__zhuffman_lookup(z, a->code_buffer);
+   if (!e || STBI__ZE_TOTAL(e) > a->num_bits)
+      return -1; /* report error for bad code or unexpected end of data. */
+   a->code_buffer >>= STBI__ZE_TOTAL(e);
+   a->num_bits -= STBI__ZE_TOTAL(e);
+   return STBI__ZE_VALUE(e);
+}
+
+static int stbi__zspill_flush(void *user, stbi_uc *data, int len)
+{
+   stbi__zbuf *z = (stbi__zbuf *) user;
+   int n = z->dest_len - z->dest_pos;
+   if (n > len) n = len;
+   if (n > 0) {
+      memcpy(z->dest + z->dest_pos, data, n);
+      z->dest_pos += n;
    }
-   return stbi__zhuffman_decode_slowpath(a, z);
+   return 1;
+}
+
+#define STBI__ZSPILL_SIZE  (32768 + 65536)
+
+// dest is full: move the last 32K into a scratch window and carry on in
+// window mode, with flush filling whatever is left of dest
+static int stbi__zspill(stbi__zbuf *z)
+{
+   int keep = (int) (z->zout - z->zout_start);
+   if (keep > 32768) keep = 32768;
+   z->spill = (char *) stbi__malloc(STBI__ZSPILL_SIZE);
+   if (z->spill == NULL) return stbi__err("outofmem", "Out of memory");
+   memcpy(z->spill, z->zout - keep, keep);
+   z->dest_pos   = (int) (z->zout - z->zout_start) - keep;
+   z->zout_start = z->spill;
+   z->zout       = z->spill + keep;
+   z->zout_end   = z->spill + STBI__ZSPILL_SIZE;
+   z->flush      = stbi__zspill_flush;
+   z->flush_user = z;
+   return 1;
 }
 
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
@@ -4206,6 +7911,19 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    unsigned int cur, limit, old_limit;
    z->zout = zout;
+   if (z->dest && !z->spill)
+      if (!stbi__zspill(z)) return 0;
+   if (z->flush) {
+      // slide the window, keeping the last 32K for back-references
+      int drop = (int) (z->zout - z->zout_start) - 32768;
+      if (drop > 0) {
+         if (!z->flush(z->flush_user, (stbi_uc *) z->zout_start, drop)) return 0;
+         memmove(z->zout_start, z->zout_start + drop, 32768);
+         z->zout -= drop;
+      }
+      if (z->zout + n > z->zout_end) return stbi__err("output buffer limit","Corrupt PNG");
+      return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
@@ -4214,7 +7932,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4223,58 +7941,86 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    return 1;
 }
 
-static const int stbi__zlength_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
-
-static const int stbi__zlength_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
-
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
-
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
+   // keep the bit buffer and pointers in locals; stores through zout
+   // could alias them and force a reload on every symbol otherwise
    char *zout = a->zout;
+   stbi_uc *in = a->zbuffer;
+   stbi__uint64 bits = a->code_buffer;
+   int nbits = a->num_bits;
+   stbi__zhuffman *z_length = a->z_length, *z_distance = a->z_distance;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+      stbi__uint32 e;
+      int len,dist,n;
+      // top up to 56+ bits, enough for a whole length/distance pair (48 bits
+      // at most); take 8 bytes in one load while that many are left
+      if (a->zbuffer_end - in >= 8) {
+         n = (63 - nbits) >> 3;
+         bits |= (stbi__zload64(in) << nbits) & (((stbi__uint64) 1 << (nbits + 8*n)) - 1);
+         in += n;
+         nbits += 8*n;
+      } else {
+         while (nbits <= 56 && in < a->zbuffer_end) {
+            bits |= (stbi__uint64) *in++ << nbits;
+            nbits += 8;
+         }
+      }
+      e = stbi__zhuffman_lookup(z_length, bits);
+      if (!e || STBI__ZE_TOTAL(e) > nbits) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+      if (STBI__ZE_KIND(e) == STBI__ZK_VALUE) {
+         bits >>= STBI__ZE_TOTAL(e);
+         nbits -= STBI__ZE_TOTAL(e);
          if (zout >= a->zout_end) {
             if (!stbi__zexpand(a, zout, 1)) return 0;
             zout = a->zout;
          }
-         *zout++ = (char) z;
+         *zout++ = (char) STBI__ZE_VALUE(e);
+         continue;
+      }
+      if (STBI__ZE_KIND(e) == STBI__ZK_EOB) {
+         a->code_buffer = bits >> STBI__ZE_TOTAL(e);
+         a->num_bits = nbits - STBI__ZE_TOTAL(e);
+         a->zbuffer = in;
+         a->zout = zout;
+         return 1;
+      }
+      if (STBI__ZE_KIND(e) == STBI__ZK_BAD) return stbi__err("bad huffman code","Corrupt PNG");
+      len = STBI__ZE_VALUE(e) + (int) ((bits & ((1u << STBI__ZE_TOTAL(e)) - 1)) >> STBI__ZE_CODE(e));
+      bits >>= STBI__ZE_TOTAL(e);
+      nbits -= STBI__ZE_TOTAL(e);
+      e = stbi__zhuffman_lookup(z_distance, bits);
+      if (!e || STBI__ZE_TOTAL(e) > nbits || STBI__ZE_KIND(e) != STBI__ZK_BASE) return stbi__err("bad huffman code","Corrupt PNG");
+      dist = STBI__ZE_VALUE(e) + (int) ((bits & ((1u << STBI__ZE_TOTAL(e)) - 1)) >> STBI__ZE_CODE(e));
+      bits >>= STBI__ZE_TOTAL(e);
+      nbits -= STBI__ZE_TOTAL(e);
+      if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+      if (a->zout_end - zout >= len + 16) {
+         // room to overshoot: copy in whole chunks, the tail gets overwritten later
+         stbi_uc *p = (stbi_uc *) (zout - dist);
+         char *end = zout + len;
+         if (dist >= 16) {
+            do { memcpy(zout, p, 16); zout += 16; p += 16; } while (zout < end);
+         } else if (dist >= 8) {
+            do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
+         } else {
+            // short period (dist 1 is a run of one byte; common in images):
+            // spell out 8 bytes of the pattern, then step by whole periods
+            stbi_uc pat[8];
+            int i, step = 8 - 8 % dist;
+            for (i=0; i < dist; ++i) pat[i] = p[i];
+            for (   ; i < 8; ++i) pat[i] = pat[i-dist];
+            do { memcpy(zout, pat, 8); zout += step; } while (zout < end);
+         }
+         zout = end;
       } else {
          stbi_uc *p;
-         int len,dist;
-         if (z == 256) {
-            a->zout = zout;
-            return 1;
-         }
-         z -= 257;
-         len = stbi__zlength_base[z];
-         if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
-         z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
-         dist = stbi__zdist_base[z];
-         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
-         if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
          if (zout + len > a->zout_end) {
             if (!stbi__zexpand(a, zout, len)) return 0;
             zout = a->zout;
          }
          p = (stbi_uc *) (zout - dist);
-         if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
-         } else {
-            if (len) { do *zout++ = *p++; while (--len); }
-         }
+         do *zout++ = *p++; while (--len);
       }
    }
 }
@@ -4282,7 +8028,8 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
 static int stbi__compute_huffman_codes(stbi__zbuf *a)
 {
    static const stbi_uc length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-   stbi__zhuffman z_codelength;
+   stbi__zhuffman z_codelength_local, *z_codelength = &z_codelength_local;
+   stbi__zcache *zc = a->cache;
    stbi_uc lencodes[286+32+137];//padding for maximum single op
    stbi_uc codelength_sizes[19];
    int i,n;
@@ -4297,11 +8044,23 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       int s = stbi__zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (stbi_uc) s;
    }
-   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (zc && zc->have_codelength && memcmp(zc->codelength_sizes, codelength_sizes, 19) == 0) {
+      z_codelength = &zc->codelength;
+   } else {
+      if (zc) {
+         zc->have_codelength = 0;
+         z_codelength = &zc->codelength;
+      }
+      if (!stbi__zbuild_huffman(z_codelength, codelength_sizes, 19, STBI__ZA_PLAIN)) return 0;
+      if (zc) {
+         memcpy(zc->codelength_sizes, codelength_sizes, 19);
+         zc->have_codelength = 1;
+      }
+   }
 
    n = 0;
    while (n < ntot) {
-      int c = stbi__zhuffman_decode(a, &z_codelength);
+      int c = stbi__zhuffman_decode(a, z_codelength);
       if (c < 0 || c >= 19) return stbi__err("bad codelengths", "Corrupt PNG");
       if (c < 16)
          lencodes[n++] = (stbi_uc) c;
@@ -4324,8 +8083,23 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       }
    }
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
-   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (!zc) {
+      a->z_length = &a->z_tables[0];
+      a->z_distance = &a->z_tables[1];
+   } else {
+      a->z_length = &zc->length;
+      a->z_distance = &zc->distance;
+      if (zc->hlit == hlit && zc->hdist == hdist && memcmp(zc->lencodes, lencodes, ntot) == 0)
+         return 1; // same code lengths as the block these were built for
+      zc->hlit = zc->hdist = 0;
+   }
+   if (!stbi__zbuild_huffman(a->z_length, lencodes, hlit, STBI__ZA_LITLEN)) return 0;
+   if (!stbi__zbuild_huffman(a->z_distance, lencodes+hlit, hdist, STBI__ZA_DIST)) return 0;
+   if (zc) {
+      memcpy(zc->lencodes, lencodes, ntot);
+      zc->hlit = hlit;
+      zc->hdist = hdist;
+   }
    return 1;
 }
 
@@ -4335,17 +8109,13 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    int len,nlen,k;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
-   while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
-   }
-   if (a->num_bits < 0) return stbi__err("zlib corrupt","Corrupt PNG");
-   // now fill header the normal way
-   while (k < 4)
-      header[k++] = stbi__zget8(a);
+   // the bit buffer only holds whole bytes read ahead of zbuffer, so
+   // hand them back and read the header the normal way
+   a->zbuffer -= a->num_bits >> 3;
+   a->code_buffer = 0;
+   a->num_bits = 0;
+   for (k=0; k < 4; ++k)
+      header[k] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
@@ -4418,8 +8188,14 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
-            if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+            stbi__zcache *zc = a->cache;
+            a->z_length   = zc ? &zc->fixed_length   : &a->z_tables[0];
+            a->z_distance = zc ? &zc->fixed_distance : &a->z_tables[1];
+            if (!zc || !zc->have_fixed) {
+               if (!stbi__zbuild_huffman(a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS, STBI__ZA_LITLEN)) return 0;
+               if (!stbi__zbuild_huffman(a->z_distance, stbi__zdefault_distance,  32, STBI__ZA_DIST)) return 0;
+               if (zc) zc->have_fixed = 1;
+            }
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
@@ -4435,10 +8211,56 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->flush      = NULL;
+   a->dest       = NULL;
 
    return stbi__parse_zlib(a, parse_header);
 }
 
+// decode into exactly olen bytes at obuf with no reallocation; a stream that
+// runs longer is still decoded to the end, but the excess is dropped
+static int stbi__do_zlib_bounded(stbi__zbuf *a, char *obuf, int olen, int parse_header)
+{
+   int r;
+   a->zout_start = obuf;
+   a->zout       = obuf;
+   a->zout_end   = obuf + olen;
+   a->z_expandable = 0;
+   a->flush      = NULL;
+   a->dest       = obuf;
+   a->dest_len   = olen;
+   a->spill      = NULL;
+
+   r = stbi__parse_zlib(a, parse_header);
+   if (a->spill) {
+      if (r) stbi__zspill_flush(a, (stbi_uc *) a->zout_start, (int) (a->zout - a->zout_start));
+      stbi__free(a->spill);
+      a->spill = NULL;
+      a->zout_start = obuf;
+      a->zout = obuf + a->dest_pos;
+   }
+   return r;
+}
+
+// decode through a fixed window of wlen bytes (at least 32K + 64K, the
+// largest stored block), handing the output to flush in order
+static int stbi__do_zlib_window(stbi__zbuf *a, char *window, int wlen, int parse_header, int (*flush)(void *user, stbi_uc *data, int len), void *user)
+{
+   STBI_ASSERT(wlen >= 32768 + 65536);
+   a->zout_start = window;
+   a->zout       = window;
+   a->zout_end   = window + wlen;
+   a->z_expandable = 0;
+   a->flush      = flush;
+   a->flush_user = user;
+   a->dest       = NULL;
+
+   if (!stbi__parse_zlib(a, parse_header)) return 0;
+   if (a->zout > a->zout_start)
+      if (!flush(user, (stbi_uc *) a->zout_start, (int) (a->zout - a->zout_start))) return 0;
+   return 1;
+}
+
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    stbi__zbuf a;
@@ -4446,11 +8268,12 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
+   a.cache = NULL;
    if (stbi__do_zlib(&a, p, initial_size, 1, 1)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4467,11 +8290,12 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
+   a.cache = NULL;
    if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4481,12 +8305,30 @@ STBIDEF int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
+   a.cache = NULL;
    if (stbi__do_zlib(&a, obuffer, olen, 0, 1))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
 }
 
+static int stbi__zlib_decode_into(char *obuffer, int olen, const char *ibuffer, int ilen, int parse_header, stbi__zcache *cache)
+{
+   stbi__zbuf a;
+   a.zbuffer = (stbi_uc *) ibuffer;
+   a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
+   a.cache = cache;
+   if (stbi__do_zlib_bounded(&a, obuffer, olen, parse_header))
+      return (int) (a.zout - a.zout_start);
+   else
+      return -1;
+}
+
+STBIDEF int stbi_zlib_decode_into(char *obuffer, int olen, const char *ibuffer, int ilen, int parse_header)
+{
+   return stbi__zlib_decode_into(obuffer, olen, ibuffer, ilen, parse_header, NULL);
+}
+
 STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
 {
    stbi__zbuf a;
@@ -4494,11 +8336,12 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer+len;
+   a.cache = NULL;
    if (stbi__do_zlib(&a, p, 16384, 1, 0)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4508,6 +8351,7 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
+   a.cache = NULL;
    if (stbi__do_zlib(&a, obuffer, olen, 0, 0))
       return (int) (a.zout - a.zout_start);
    else
@@ -4554,8 +8398,25 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   stbi_uc *palette;   // if set, indices become pal_n-channel colors as each row is unfiltered
+   int pal_n;
+   int half;           // write 16-bit samples as half floats
 } stbi__png;
 
+// the zlib tables a stbi_decoder keeps for PNGs, or NULL to build them from scratch
+static stbi__zcache *stbi__png_zcache(stbi__context *s)
+{
+   stbi__zcache *zc;
+   if (!s->dec) return NULL;
+   if (!s->dec->zlib) {
+      zc = (stbi__zcache *) stbi__malloc(sizeof(stbi__zcache));
+      if (!zc) return NULL; // works without
+      zc->have_fixed = zc->have_codelength = 0;
+      zc->hlit = zc->hdist = 0;
+      s->dec->zlib = zc;
+   }
+   return (stbi__zcache *) s->dec->zlib;
+}
 
 enum {
    STBI__F_none=0,
@@ -4590,23 +8451,434 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+#ifdef STBI_SSE2
+// SSE2 unfiltering for 8- and 16-bit rows (filters work on bytes, so 16-bit
+// samples are just wider pixels). up runs 16 bytes at a time; sub, avg and
+// paeth depend on the pixel to the left, so they go a pixel at a time with
+// all its channels in parallel, as libpng does. pixels move with 8-byte
+// loads and stores: the kernels stop while fewer than 8 bytes of the row are
+// left and the scalar loops finish it, and whatever is stored past a pixel
+// is rewritten by the next one.
+static stbi__uint32 stbi__png_unfilter_up_sse2(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, stbi__uint32 n)
+{
+   stbi__uint32 k;
+   for (k=0; k + 16 <= n; k += 16) {
+      __m128i d = _mm_add_epi8(_mm_loadu_si128((__m128i *) (raw+k)), _mm_loadu_si128((__m128i *) (prior+k)));
+      _mm_storeu_si128((__m128i *) (cur+k), d);
+   }
+   return k;
+}
+
+// unfilters up to count pixels, fb bytes each in raw and ob bytes each in
+// cur and prior; output bytes past fb are alpha and set to 255. returns the
+// number of pixels done.
+static stbi__uint32 stbi__png_unfilter_px_sse2(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int filter, stbi__uint32 count, int fb, int ob)
+{
+   static const stbi_uc lanes[16] = { 255,255,255,255,255,255,255,255, 0,0,0,0,0,0,0,0 };
+   __m128i zero  = _mm_setzero_si128();
+   __m128i keep  = _mm_loadl_epi64((__m128i *) (lanes + 8 - fb)); // the fb bytes of a raw pixel
+   __m128i alpha = _mm_andnot_si128(keep, _mm_loadl_epi64((__m128i *) (lanes + 8 - ob)));
+   __m128i a, b, c, d;
+   stbi__uint32 i, n, tail = (8 + fb - 1) / fb - 1; // pixels left over for the scalar loop
+
+   if (count <= tail) return 0;
+   n = count - tail;
+   a = _mm_loadl_epi64((__m128i *) (cur - ob));
+   switch (filter) {
+      case STBI__F_none:
+         for (i=0; i < n; ++i, raw += fb, cur += ob) {
+            d = _mm_or_si128(_mm_and_si128(_mm_loadl_epi64((__m128i *) raw), keep), alpha);
+            _mm_storel_epi64((__m128i *) cur, d);
+         }
+         break;
+      case STBI__F_sub:
+      case STBI__F_paeth_first:
+         for (i=0; i < n; ++i, raw += fb, cur += ob) {
+            a = _mm_add_epi8(a, _mm_and_si128(_mm_loadl_epi64((__m128i *) raw), keep));
+            a = _mm_or_si128(a, alpha);
+            _mm_storel_epi64((__m128i *) cur, a);
+         }
+         break;
+      case STBI__F_up:
+         for (i=0; i < n; ++i, raw += fb, cur += ob, prior += ob) {
+            d = _mm_add_epi8(_mm_loadl_epi64((__m128i *) prior), _mm_and_si128(_mm_loadl_epi64((__m128i *) raw), keep));
+            _mm_storel_epi64((__m128i *) cur, _mm_or_si128(d, alpha));
+         }
+         break;
+      case STBI__F_avg:
+      case STBI__F_avg_first: {
+         // pavgb rounds up; take back the carry where a+b is odd
+         __m128i one   = _mm_set1_epi8(1);
+         __m128i above = filter == STBI__F_avg ? _mm_set1_epi8(-1) : zero;
+         for (i=0; i < n; ++i, raw += fb, cur += ob, prior += ob) {
+            b = _mm_and_si128(_mm_loadl_epi64((__m128i *) prior), above);
+            d = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            a = _mm_add_epi8(d, _mm_and_si128(_mm_loadl_epi64((__m128i *) raw), keep));
+            a = _mm_or_si128(a, alpha);
+            _mm_storel_epi64((__m128i *) cur, a);
+         }
+         break;
+      }
+      case STBI__F_paeth:
+         // with p = a+b-c: |p-a| = |b-c|, |p-b| = |a-c|, |p-c| = |a+b-2c|
+         a = _mm_unpacklo_epi8(a, zero);
+         c = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) (prior - ob)), zero);
+         for (i=0; i < n; ++i, raw += fb, cur += ob, prior += ob) {
+            __m128i pa, pb, pc, m, nearest;
+            b  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) prior), zero);
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            m  = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            // a if pa is smallest, else b if pb is, else c
+            nearest = _mm_cmpeq_epi16(pb, m);
+            nearest = _mm_or_si128(_mm_and_si128(nearest, b), _mm_andnot_si128(nearest, c));
+            m = _mm_cmpeq_epi16(pa, m);
+            nearest = _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, nearest));
+            d = _mm_add_epi8(_mm_packus_epi16(nearest, nearest), _mm_and_si128(_mm_loadl_epi64((__m128i *) raw), keep));
+            d = _mm_or_si128(d, alpha);
+            _mm_storel_epi64((__m128i *) cur, d);
+            a = _mm_unpacklo_epi8(d, zero);
+            c = b;
+         }
+         break;
+   }
+   return n;
+}
+#endif
+
+// unfilter one scanline. raw is the scanline after its filter byte; cur and
+// prior are the start of this and the previous output row (prior's contents
+// are ignored for the first row). for depth < 8 the packed bytes are stored
+// at the right end of the row and expanded by stbi__png_expand_row later.
+static int stbi__png_unfilter_row(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int filter, int first_row, int img_n, int out_n, stbi__uint32 x, int depth)
 {
    int bytes = (depth == 16? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
+   stbi__uint32 i, img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   stbi_uc *row = cur;
    int k;
-   int img_n = s->img_n; // copy it into a local for later
 
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   if (filter > 4)
+      return stbi__err("invalid filter","Corrupt PNG");
+
+   if (depth < 8) {
+      if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
+      cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
+      prior += x*out_n - img_width_bytes;
+      filter_bytes = 1;
+      width = img_width_bytes;
+   }
+
+   // if first row, use special filter that doesn't sample previous row
+   if (first_row) filter = first_row_filter[filter];
+
+   // handle first byte explicitly
+   for (k=0; k < filter_bytes; ++k) {
+      switch (filter) {
+         case STBI__F_none       : cur[k] = raw[k]; break;
+         case STBI__F_sub        : cur[k] = raw[k]; break;
+         case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
+         case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
+         case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
+         case STBI__F_avg_first  : cur[k] = raw[k]; break;
+         case STBI__F_paeth_first: cur[k] = raw[k]; break;
+      }
+   }
+
+   if (depth == 8) {
+      if (img_n != out_n)
+         cur[img_n] = 255; // first pixel
+      raw += img_n;
+      cur += out_n;
+      prior += out_n;
+   } else if (depth == 16) {
+      if (img_n != out_n) {
+         cur[filter_bytes]   = 255; // first pixel top byte
+         cur[filter_bytes+1] = 255; // first pixel bottom byte
+      }
+      raw += filter_bytes;
+      cur += output_bytes;
+      prior += output_bytes;
+   } else {
+      raw += 1;
+      cur += 1;
+      prior += 1;
+   }
+
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (depth < 8 || img_n == out_n) {
+      int nk = (width - 1)*filter_bytes;
+      #ifdef STBI_SSE2
+      if (depth >= 8 && filter != STBI__F_none && stbi__sse2_available()) {
+         int done;
+         if (filter == STBI__F_up)
+            done = (int) stbi__png_unfilter_up_sse2(cur, prior, raw, nk);
+         else
+            done = (int) stbi__png_unfilter_px_sse2(cur, prior, raw, filter, width - 1, filter_bytes, filter_bytes) * filter_bytes;
+         cur += done;
+         prior += done;
+         raw += done;
+         nk -= done;
+      }
+      #endif
+      #define STBI__CASE(f) \
+          case f:     \
+             for (k=0; k < nk; ++k)
+      switch (filter) {
+         // "none" filter turns into a memcpy here; make that explicit.
+         case STBI__F_none:         memcpy(cur, raw, nk); break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
+      }
+      #undef STBI__CASE
+      raw += nk;
+   } else {
+      stbi__uint32 left = x-1;
+      STBI_ASSERT(img_n+1 == out_n);
+      #ifdef STBI_SSE2
+      if (stbi__sse2_available()) {
+         stbi__uint32 done = stbi__png_unfilter_px_sse2(cur, prior, raw, filter, left, filter_bytes, output_bytes);
+         raw += done*filter_bytes;
+         cur += done*output_bytes;
+         prior += done*output_bytes;
+         left -= done;
+      }
+      #endif
+      #define STBI__CASE(f) \
+          case f:     \
+             for (i=left; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
+                for (k=0; k < filter_bytes; ++k)
+      switch (filter) {
+         STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
+      }
+      #undef STBI__CASE
+
+      // the loop above sets the high byte of the pixels' alpha, but for
+      // 16 bit png files we also need the low byte set. we'll do that here.
+      if (depth == 16) {
+         cur = row; // start at the beginning of the row again
+         for (i=0; i < x; ++i,cur+=output_bytes) {
+            cur[filter_bytes+1] = 255;
+         }
+      }
+   }
+   return 1;
+}
+
+// unpack the 1/2/4-bit samples stored at the right end of a row by
+// stbi__png_unfilter_row to 8 bits each, and insert alpha if needed
+static void stbi__png_expand_row(stbi_uc *row, stbi__uint32 x, int img_n, int out_n, int depth, int color)
+{
+   stbi__uint32 img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   int k;
+   stbi_uc *cur = row;
+   stbi_uc *in  = row + x*out_n - img_width_bytes;
+   // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+   // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+   stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+   // note that the final byte might overshoot and write more data than desired.
+   // we can allocate enough data that this never writes out of memory, but it
+   // could also overwrite the next scanline. can it overwrite non-empty data
+   // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+   // so we need to explicitly clamp the final ones
+
+   if (depth == 4) {
+      for (k=x*img_n; k >= 2; k-=2, ++in) {
+         *cur++ = scale * ((*in >> 4)       );
+         *cur++ = scale * ((*in     ) & 0x0f);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 4)       );
+   } else if (depth == 2) {
+      for (k=x*img_n; k >= 4; k-=4, ++in) {
+         *cur++ = scale * ((*in >> 6)       );
+         *cur++ = scale * ((*in >> 4) & 0x03);
+         *cur++ = scale * ((*in >> 2) & 0x03);
+         *cur++ = scale * ((*in     ) & 0x03);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 6)       );
+      if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+      if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+   } else if (depth == 1) {
+      for (k=x*img_n; k >= 8; k-=8, ++in) {
+         *cur++ = scale * ((*in >> 7)       );
+         *cur++ = scale * ((*in >> 6) & 0x01);
+         *cur++ = scale * ((*in >> 5) & 0x01);
+         *cur++ = scale * ((*in >> 4) & 0x01);
+         *cur++ = scale * ((*in >> 3) & 0x01);
+         *cur++ = scale * ((*in >> 2) & 0x01);
+         *cur++ = scale * ((*in >> 1) & 0x01);
+         *cur++ = scale * ((*in     ) & 0x01);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 7)       );
+      if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+      if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+      if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+      if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+      if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+      if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
+   }
+   if (img_n != out_n) {
+      int q;
+      // insert alpha = 255
+      cur = row;
+      if (img_n == 1) {
+         for (q=x-1; q >= 0; --q) {
+            cur[q*2+1] = 255;
+            cur[q*2+0] = cur[q];
+         }
+      } else {
+         STBI_ASSERT(img_n == 3);
+         for (q=x-1; q >= 0; --q) {
+            cur[q*4+3] = 255;
+            cur[q*4+2] = cur[q*3+2];
+            cur[q*4+1] = cur[q*3+1];
+            cur[q*4+0] = cur[q*3+0];
+         }
+      }
+   }
+}
+
+#ifdef STBI_AVX2
+// palette lookup, 8 or 16 pixels at a time. 1/2/4-bit indices can only
+// reach the first 16 entries, so they index the palette split into R,G,B,A
+// planes with pshufb; 8-bit indices gather whole 4-byte entries. returns
+// the number of pixels done. 3-channel output is stored 16 bytes at a time
+// with 4 bytes of overshoot, so it stops a couple of pixels early
+static STBI__AVX2_TARGET stbi__uint32 stbi__png_palette_row_avx2(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, int depth, stbi_uc const *palette, int pal_n)
+{
+   __m128i rgb = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+   stbi__uint32 i = 0, tail = (pal_n == 3 ? 2 : 0);
+
+   if (depth == 8) {
+      __m256i rgb2 = _mm256_broadcastsi128_si256(rgb);
+      for (; i + 8 + tail <= x; i += 8) {
+         __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (in + i)));
+         __m256i px = _mm256_i32gather_epi32((const int *) palette, idx, 4);
+         if (pal_n == 4) {
+            _mm256_storeu_si256((__m256i *) (out + i*4), px);
+         } else {
+            px = _mm256_shuffle_epi8(px, rgb2);
+            _mm_storeu_si128((__m128i *) (out + i*3     ), _mm256_castsi256_si128(px));
+            _mm_storeu_si128((__m128i *) (out + i*3 + 12), _mm256_extracti128_si256(px, 1));
+         }
+      }
+   } else {
+      // transpose entries 0..15 into one register per channel
+      __m128i ch = _mm_setr_epi8(0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15);
+      __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (palette     )), ch);
+      __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (palette + 16)), ch);
+      __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (palette + 32)), ch);
+      __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (palette + 48)), ch);
+      __m128i t0 = _mm_unpacklo_epi32(p0, p1), t1 = _mm_unpackhi_epi32(p0, p1);
+      __m128i t2 = _mm_unpacklo_epi32(p2, p3), t3 = _mm_unpackhi_epi32(p2, p3);
+      __m128i pr = _mm_unpacklo_epi64(t0, t2), pg = _mm_unpackhi_epi64(t0, t2);
+      __m128i pb = _mm_unpacklo_epi64(t1, t3), pa = _mm_unpackhi_epi64(t1, t3);
+      __m128i m2 = _mm_set1_epi8(3), m4 = _mm_set1_epi8(15);
+      __m128i spread = _mm_setr_epi8(0,0,0,0,0,0,0,0, 1,1,1,1,1,1,1,1);
+      __m128i bit = _mm_setr_epi8(-128,64,32,16,8,4,2,1, -128,64,32,16,8,4,2,1);
+      for (; i + 16 + tail <= x; i += 16) {
+         // 16 indices, most significant bits first within each byte
+         __m128i idx, r, g, b, a, rg0, rg1, ba0, ba1, q[4];
+         stbi_uc const *src = in + ((i * depth) >> 3);
+         int k;
+         if (depth == 4) {
+            __m128i v = _mm_loadl_epi64((const __m128i *) src);
+            idx = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), m4), _mm_and_si128(v, m4));
+         } else if (depth == 2) {
+            int w;
+            __m128i v;
+            memcpy(&w, src, 4);
+            v = _mm_cvtsi32_si128(w);
+            idx = _mm_unpacklo_epi16(
+               _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 6), m2), _mm_and_si128(_mm_srli_epi16(v, 4), m2)),
+               _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 2), m2), _mm_and_si128(v, m2)));
+         } else {
+            __m128i v = _mm_cvtsi32_si128(src[0] | (src[1] << 8));
+            v = _mm_and_si128(_mm_shuffle_epi8(v, spread), bit);
+            idx = _mm_and_si128(_mm_cmpeq_epi8(v, bit), _mm_set1_epi8(1));
+         }
+         r = _mm_shuffle_epi8(pr, idx);
+         g = _mm_shuffle_epi8(pg, idx);
+         b = _mm_shuffle_epi8(pb, idx);
+         a = _mm_shuffle_epi8(pa, idx);
+         rg0 = _mm_unpacklo_epi8(r, g); rg1 = _mm_unpackhi_epi8(r, g);
+         ba0 = _mm_unpacklo_epi8(b, a); ba1 = _mm_unpackhi_epi8(b, a);
+         q[0] = _mm_unpacklo_epi16(rg0, ba0); q[1] = _mm_unpackhi_epi16(rg0, ba0);
+         q[2] = _mm_unpacklo_epi16(rg1, ba1); q[3] = _mm_unpackhi_epi16(rg1, ba1);
+         if (pal_n == 4) {
+            for (k=0; k < 4; ++k)
+               _mm_storeu_si128((__m128i *) (out + i*4 + k*16), q[k]);
+         } else {
+            for (k=0; k < 4; ++k)
+               _mm_storeu_si128((__m128i *) (out + i*3 + k*12), _mm_shuffle_epi8(q[k], rgb));
+         }
+      }
+   }
+   return i;
+}
+#endif
+
+// look up a row of x 1/2/4/8-bit palette indices, packed as in the file,
+// and store pal_n-channel colors (every palette entry is 4 bytes)
+static void stbi__png_palette_row(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, int depth, stbi_uc const *palette, int pal_n)
+{
+   stbi__uint32 i = 0, n;
+   int mask = (1 << depth) - 1;
+
+   #ifdef STBI_AVX2
+   if (stbi__avx2_available())
+      i = stbi__png_palette_row_avx2(out, in, x, depth, palette, pal_n);
+   #endif
+   // copy whole entries; for 3-channel output the fourth byte is
+   // overwritten by the next pixel, so the last one is done separately
+   for (; i + (pal_n == 3) < x; ++i) {
+      n = depth == 8 ? in[i] : (in[(i*depth) >> 3] >> (8 - depth - ((i*depth) & 7))) & mask;
+      memcpy(out + i*pal_n, palette + n*4, 4);
+   }
+   if (i < x) {
+      n = depth == 8 ? in[i] : (in[(i*depth) >> 3] >> (8 - depth - ((i*depth) & 7))) & mask;
+      memcpy(out + i*pal_n, palette + n*4, pal_n);
+   }
+}
+
+// create the png data from post-deflated data; with flip, the rows are
+// stored bottom-up (each row still unfilters against the one decoded before it)
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, int flip)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__context *s = a->s;
+   stbi__uint32 j,stride = x*out_n*bytes;
+   stbi__uint32 img_len, img_width_bytes;
+   int img_n = s->img_n; // copy it into a local for later
+
+   int output_bytes = out_n*bytes;
+   stbi_uc *index = NULL;
+   stbi_uc *first;
+   ptrdiff_t pitch;
+
+   STBI_ASSERT(a->palette ? img_n == 1 && out_n == a->pal_n : out_n == s->img_n || out_n == s->img_n+1);
    a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
    if (!a->out) return stbi__err("outofmem", "Out of memory");
+   first = flip && y ? a->out + (size_t) stride*(y-1) : a->out;
+   pitch = flip ? -(ptrdiff_t) stride : (ptrdiff_t) stride;
 
    if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
    img_width_bytes = (((img_n * x * depth) + 7) >> 3);
@@ -4617,190 +8889,70 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    // so just check for raw_len < img_len always.
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
-      int filter = *raw++;
-
-      if (filter > 4)
-         return stbi__err("invalid filter","Corrupt PNG");
-
-      if (depth < 8) {
-         if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
-      }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
+   if (a->palette) {
+      // unfilter the indices into two alternating rows and look each row
+      // up while it's still in cache, instead of building an image of
+      // indices and expanding it in separate passes
+      index = (stbi_uc *) stbi__malloc_mad2(x, 2, 0);
+      if (!index) return stbi__err("outofmem", "Out of memory");
+      for (j=0; j < y; ++j) {
+         stbi_uc *cur = index + x*(j&1);
+         if (!stbi__png_unfilter_row(cur, index + x*((j&1)^1), raw+1, raw[0], j == 0, 1, 1, x, depth)) {
+            stbi__free(index);
+            return 0;
          }
+         stbi__png_palette_row(first + pitch*(ptrdiff_t) j, cur + x - img_width_bytes, x, depth, a->palette, out_n);
+         raw += img_width_bytes + 1;
       }
+      stbi__free(index);
+      return 1;
+   }
 
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
-         }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
-      }
-
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
-         }
-      }
+   for (j=0; j < y; ++j) {
+      stbi_uc *cur = first + pitch*(ptrdiff_t) j;
+      if (!stbi__png_unfilter_row(cur, j ? cur - pitch : cur, raw+1, raw[0], j == 0, img_n, out_n, x, depth))
+         return 0;
+      raw += img_width_bytes + 1;
+      // 16-bit samples go from big-endian to native order (or half floats)
+      // one row behind, since the next row unfilters against the raw bytes
+      if (depth == 16 && j)
+         stbi__unorm16_row((stbi__uint16 *) (cur - pitch), x*out_n, 1, a->half);
    }
+   if (depth == 16 && y)
+      stbi__unorm16_row((stbi__uint16 *) (first + pitch*(ptrdiff_t) (y-1)), x*out_n, 1, a->half);
 
    // we make a separate pass to expand bits to pixels; for performance,
    // this could run two scanlines behind the above code, so it won't
    // intefere with filtering but will still be in the cache.
    if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
+      for (j=0; j < y; ++j)
+         stbi__png_expand_row(a->out + stride*j, x, img_n, out_n, depth, color);
+   }
 
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
-         }
-      }
-   } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
-      stbi__uint16 *cur16 = (stbi__uint16*)cur;
+   return 1;
+}
 
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
-         *cur16 = (cur[0] << 8) | cur[1];
+// exact size of the inflated image data: each row of each non-empty pass is
+// one filter byte plus its packed pixels. 0 if it won't fit in an int
+static stbi__uint32 stbi__png_raw_size(stbi__uint32 img_x, stbi__uint32 img_y, int img_n, int depth, int interlaced)
+{
+   stbi__uint64 total = 0;
+   int p;
+   if (!interlaced)
+      total = (((stbi__uint64) img_x * img_n * depth + 7) / 8 + 1) * img_y;
+   else {
+      for (p=0; p < 7; ++p) {
+         int xorig[] = { 0,4,0,2,0,1,0 };
+         int yorig[] = { 0,0,4,0,2,0,1 };
+         int xspc[]  = { 8,8,4,4,2,2,1 };
+         int yspc[]  = { 8,8,8,4,4,2,2 };
+         stbi__uint32 x = (img_x - xorig[p] + xspc[p]-1) / xspc[p];
+         stbi__uint32 y = (img_y - yorig[p] + yspc[p]-1) / yspc[p];
+         if (x && y)
+            total += (((stbi__uint64) x * img_n * depth + 7) / 8 + 1) * y;
       }
    }
-
-   return 1;
+   return total > INT_MAX ? 0 : (stbi__uint32) total;
 }
 
 static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
@@ -4810,7 +8962,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    stbi_uc *final;
    int p;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, a->s->flip);
 
    // de-interlacing
    final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
@@ -4826,19 +8978,20 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, 0)) {
+            stbi__free(final);
             return 0;
          }
          for (j=0; j < y; ++j) {
             for (i=0; i < x; ++i) {
                int out_y = j*yspc[p]+yorig[p];
                int out_x = i*xspc[p]+xorig[p];
+               if (a->s->flip) out_y = a->s->img_y-1 - out_y;
                memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
-         STBI_FREE(a->out);
+         stbi__free(a->out);
          image_data += img_len;
          image_data_len -= img_len;
       }
@@ -4848,23 +9001,44 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
    STBI_ASSERT(out_n == 2 || out_n == 4);
 
+   i = 0;
+   #ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      if (out_n == 2) {
+         // 8 pixels: alpha = gray == key ? 0 : 255
+         __m128i key = _mm_set1_epi16(tc[0]), lo = _mm_set1_epi16(0x00ff), hi = _mm_set1_epi16((short) 0xff00);
+         for (; i + 8 <= pixel_count; i += 8, p += 16) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i *) p), lo);
+            _mm_storeu_si128((__m128i *) p, _mm_or_si128(v, _mm_andnot_si128(_mm_cmpeq_epi16(v, key), hi)));
+         }
+      } else {
+         // 4 pixels: clear alpha where rgb == key
+         __m128i key = _mm_set1_epi32(tc[0] | (tc[1] << 8) | (tc[2] << 16));
+         __m128i rgb = _mm_set1_epi32(0x00ffffff), alpha = _mm_set1_epi32((int) 0xff000000);
+         for (; i + 4 <= pixel_count; i += 4, p += 16) {
+            __m128i v = _mm_loadu_si128((__m128i *) p);
+            __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(v, rgb), key);
+            _mm_storeu_si128((__m128i *) p, _mm_andnot_si128(_mm_and_si128(eq, alpha), v));
+         }
+      }
+   }
+   #endif
+
    if (out_n == 2) {
-      for (i=0; i < pixel_count; ++i) {
+      for (; i < pixel_count; ++i) {
          p[1] = (p[0] == tc[0] ? 0 : 255);
          p += 2;
       }
    } else {
-      for (i=0; i < pixel_count; ++i) {
+      for (; i < pixel_count; ++i) {
          if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
             p[3] = 0;
          p += 4;
@@ -4873,11 +9047,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4895,93 +9067,36 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
          p += 4;
       }
    }
-   return 1;
-}
-
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
-{
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
-   if (pal_img_n == 3) {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p += 3;
-      }
-   } else {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p[3] = palette[n+3];
-         p += 4;
-      }
-   }
-   STBI_FREE(a->out);
-   a->out = temp_out;
-
-   STBI_NOTUSED(len);
-
-   return 1;
-}
-
-static int stbi__unpremultiply_on_load_global = 0;
-static int stbi__de_iphone_flag_global = 0;
+   return 1;
+}
 
-STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
+static void stbi__png_apply_palette(stbi_uc *p, stbi_uc const *orig, stbi__uint32 pixel_count, stbi_uc const *palette, int pal_img_n)
 {
-   stbi__unpremultiply_on_load_global = flag_true_if_should_unpremultiply;
+   stbi__png_palette_row(p, orig, pixel_count, 8, palette, pal_img_n);
 }
 
-STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
 {
-   stbi__de_iphone_flag_global = flag_true_if_should_convert;
-}
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *temp_out;
 
-#ifndef STBI_THREAD_LOCAL
-#define stbi__unpremultiply_on_load  stbi__unpremultiply_on_load_global
-#define stbi__de_iphone_flag  stbi__de_iphone_flag_global
-#else
-static STBI_THREAD_LOCAL int stbi__unpremultiply_on_load_local, stbi__unpremultiply_on_load_set;
-static STBI_THREAD_LOCAL int stbi__de_iphone_flag_local, stbi__de_iphone_flag_set;
+   temp_out = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (temp_out == NULL) return stbi__err("outofmem", "Out of memory");
 
-STBIDEF void stbi__unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply)
-{
-   stbi__unpremultiply_on_load_local = flag_true_if_should_unpremultiply;
-   stbi__unpremultiply_on_load_set = 1;
-}
+   stbi__png_apply_palette(temp_out, a->out, pixel_count, palette, pal_img_n);
+   stbi__free(a->out);
+   a->out = temp_out;
 
-STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert)
-{
-   stbi__de_iphone_flag_local = flag_true_if_should_convert;
-   stbi__de_iphone_flag_set = 1;
-}
+   STBI_NOTUSED(len);
 
-#define stbi__unpremultiply_on_load  (stbi__unpremultiply_on_load_set           \
-                                       ? stbi__unpremultiply_on_load_local      \
-                                       : stbi__unpremultiply_on_load_global)
-#define stbi__de_iphone_flag  (stbi__de_iphone_flag_set                         \
-                                ? stbi__de_iphone_flag_local                    \
-                                : stbi__de_iphone_flag_global)
-#endif // STBI_THREAD_LOCAL
+   return 1;
+}
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi_uc *p, stbi__uint32 pixel_count, int out_n, int unpremultiply)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
          p[0] = p[2];
@@ -4989,8 +9104,8 @@ static void stbi__de_iphone(stbi__png *z)
          p += 3;
       }
    } else {
-      STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
+      STBI_ASSERT(out_n == 4);
+      if (unpremultiply) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             stbi_uc a = p[3];
@@ -5020,18 +9135,376 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+// row streaming: the IDAT stream is inflated through a small window and each
+// scanline is unfiltered, expanded and converted as soon as it is complete, so
+// only two filtered rows are kept instead of the whole image
+typedef struct
+{
+   stbi__png *z;
+   stbi__stream *st;
+   stbi_uc *row[2], *line, *tmp[2];
+   int line_bytes, have;
+   stbi__uint32 y;
+   int stopped;   // got all rows the stream wants
+   int out_n, req_comp, color, has_trans, is_iphone, pal_img_n, pal_out_n;
+   stbi_uc *tc, *palette;
+   stbi__uint16 *tc16;
+} stbi__png_stream;
+
+static int stbi__png_stream_row(stbi__png_stream *ps, stbi_uc *raw)
+{
+   stbi__context *s = ps->z->s;
+   int depth = ps->z->depth, bytes = (depth == 16 ? 2 : 1);
+   stbi__uint32 i, x = s->img_x, row_bytes = x * ps->out_n * bytes;
+   stbi_uc *cur = ps->row[ps->y & 1], *p = ps->tmp[0], *q = ps->tmp[1], *t;
+   int n = ps->out_n;
+
+   if (!stbi__png_unfilter_row(cur, ps->y ? ps->row[(ps->y & 1) ^ 1] : cur, raw+1, raw[0], ps->y == 0, s->img_n, ps->out_n, x, depth))
+      return 0;
+   if ((int) ps->y < ps->st->y0) {
+      // above the region; only needed as the prior row
+      ++ps->y;
+      return 1;
+   }
+
+   // the filtered row is the next row's prior, so finish the pixels in a copy
+   memcpy(p, cur, row_bytes);
+   if (depth < 8) {
+      stbi__png_expand_row(p, x, s->img_n, ps->out_n, depth, ps->color);
+   } else if (depth == 16) {
+      stbi__uint16 *p16 = (stbi__uint16 *) p;
+      for (i=0; i < x*n; ++i)
+         p16[i] = (stbi__uint16) ((p[i*2] << 8) | p[i*2+1]);
+   }
+   // from here on, only the columns the stream wants
+   p += ps->st->x0 * n * bytes;
+   x = ps->st->x1 - ps->st->x0;
+   if (ps->has_trans) {
+      if (depth == 16) stbi__compute_transparency16((stbi__uint16 *) p, x, ps->tc16, n);
+      else             stbi__compute_transparency(p, x, ps->tc, n);
+   }
+   if (ps->is_iphone && s->opt.convert_iphone_png && n > 2)
+      stbi__de_iphone(p, x, n, s->opt.unpremultiply);
+   if (ps->pal_img_n) {
+      stbi__png_apply_palette(q, p, x, ps->palette, ps->pal_out_n);
+      n = ps->pal_out_n;
+      t = p; p = q; q = t;
+   }
+   if (ps->req_comp && ps->req_comp != n) {
+      int ok = depth == 16 ? stbi__convert_row16((stbi__uint16 *) p, (stbi__uint16 *) q, n, ps->req_comp, x)
+                           : stbi__convert_row(p, q, n, ps->req_comp, x);
+      if (!ok) return stbi__err("unsupported", "Unsupported format conversion");
+      n = ps->req_comp;
+      t = p; p = q; q = t;
+   }
+   if (depth == 16) {
+      // same narrowing as stbi__convert_16_to_8
+      stbi__uint16 *p16 = (stbi__uint16 *) p;
+      for (i=0; i < x*n; ++i)
+         p[i] = (stbi_uc) ((p16[i] >> 8) & 0xFF);
+   }
+   if (!stbi__stream_rows(ps->st, ps->y, 1, p)) return 0;
+   ++ps->y;
+   return 1;
+}
+
+// zlib window flush: cut the inflated data into filtered scanlines
+static int stbi__png_stream_flush(void *user, stbi_uc *data, int len)
+{
+   stbi__png_stream *ps = (stbi__png_stream *) user;
+   stbi__uint32 img_y = ps->z->s->img_y;
+   while (len > 0 && (int) ps->y < ps->st->y1) {
+      if (ps->have == 0 && len >= ps->line_bytes) {
+         if (!stbi__png_stream_row(ps, data)) return 0;
+         data += ps->line_bytes;
+         len  -= ps->line_bytes;
+      } else {
+         int k = ps->line_bytes - ps->have;
+         if (k > len) k = len;
+         memcpy(ps->line + ps->have, data, k);
+         ps->have += k;
+         data += k;
+         len  -= k;
+         if (ps->have == ps->line_bytes) {
+            if (!stbi__png_stream_row(ps, ps->line)) return 0;
+            ps->have = 0;
+         }
+      }
+   }
+   if ((int) ps->y >= ps->st->y1 && ps->y < img_y) {
+      // nothing more is wanted; stop inflating
+      ps->stopped = 1;
+      return 0;
+   }
+   // like the whole-image path, ignore any data past the last row
+   return 1;
+}
+
+static int stbi__png_stream_image(stbi__png_stream *ps, stbi__uint32 ioff, int parse_header)
+{
+   stbi__png *z = ps->z;
+   stbi__context *s = z->s;
+   stbi__uint32 x = s->img_x;
+   int bytes = (z->depth == 16 ? 2 : 1), comp, n, ok;
+   size_t row_bytes, tmp_bytes;
+   stbi_uc *mem;
+   stbi__zbuf a;
+
+   if (!stbi__mad3sizes_valid(s->img_n, x, z->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   ps->line_bytes = (int) (((s->img_n * x * z->depth) + 7) >> 3) + 1;
+   ps->have = 0;
+   ps->y = 0;
+   ps->stopped = 0;
+   row_bytes = (size_t) x * ps->out_n * bytes;
+   tmp_bytes = (size_t) x * 4 * bytes;
+   mem = (stbi_uc *) stbi__scratch_malloc(s->scratch, 2*row_bytes + 2*tmp_bytes + ps->line_bytes + (1 << 17));
+   if (!mem) return stbi__err("outofmem", "Out of memory");
+   ps->row[0] = mem;
+   ps->row[1] = ps->row[0] + row_bytes;
+   ps->tmp[0] = ps->row[1] + row_bytes;
+   ps->tmp[1] = ps->tmp[0] + tmp_bytes;
+   ps->line   = ps->tmp[1] + tmp_bytes;
+
+   comp = ps->pal_img_n ? ps->pal_img_n : s->img_n + ps->has_trans;
+   n = ps->req_comp ? ps->req_comp : comp;
+   ok = stbi__stream_begin(ps->st, x, s->img_y, comp, n);
+   if (ok) {
+      ps->st->row_x = ps->st->x0;
+      ps->st->row_bytes = (ps->st->x1 - ps->st->x0) * n;
+      a.zbuffer = z->idata;
+      a.zbuffer_end = z->idata + ioff;
+      a.cache = stbi__png_zcache(s);
+      ok = stbi__do_zlib_window(&a, (char *) ps->line + ps->line_bytes, 1 << 17, parse_header, stbi__png_stream_flush, ps);
+      if (ps->stopped) ok = 1;
+   }
+   if (ok && !ps->stopped && ps->y < s->img_y)
+      ok = stbi__err("not enough pixels","Corrupt PNG");
+   stbi__scratch_free(s->scratch, mem);
+   s->img_n = comp;
+   return ok;
+}
+
+#ifdef STBI_THREADS
+// pipelined whole-image decode: the calling thread inflates and cuts the
+// output into filtered scanlines in a ring, a worker unfilters them into
+// the image as they arrive. unpacking sub-byte pixels and swapping 16-bit
+// samples run one row behind, since the next row unfilters against the
+// raw bytes.
+typedef struct
+{
+   stbi__png *z;
+   stbi_uc *ring;
+   int slots, line_bytes, have;
+   int out_n, color;
+   stbi__uint32 y;       // rows complete in the ring
+   stbi__uint32 done;    // rows the worker has finished with
+   int finished;         // the inflater is done, successfully or not
+   int failed;           // the worker hit an error
+   const char *reason;   // ... and this is why (failure reasons are per-thread)
+   stbi__mutex lock;
+   stbi__cond cond;
+} stbi__png_pipe;
+
+// image row j; with flip the rows are stored bottom-up, like the whole-image path
+static stbi_uc *stbi__png_pipe_row(stbi__png_pipe *pp, stbi__uint32 j)
+{
+   stbi__context *s = pp->z->s;
+   size_t stride = (size_t) s->img_x * pp->out_n * (pp->z->depth == 16 ? 2 : 1);
+   return pp->z->out + stride * (s->flip ? s->img_y-1 - j : j);
+}
+
+static void stbi__png_pipe_finish_row(stbi__png_pipe *pp, stbi__uint32 j)
+{
+   stbi__context *s = pp->z->s;
+   int depth = pp->z->depth;
+   stbi__uint32 n = s->img_x * pp->out_n;
+   stbi_uc *row = stbi__png_pipe_row(pp, j);
+   if (depth < 8)
+      stbi__png_expand_row(row, s->img_x, s->img_n, pp->out_n, depth, pp->color);
+   else if (depth == 16)
+      stbi__unorm16_row((stbi__uint16 *) row, n, 1, pp->z->half);
+}
+
+static void stbi__png_pipe_unfilter(void *user, int index)
+{
+   stbi__png_pipe *pp = (stbi__png_pipe *) user;
+   stbi__context *s = pp->z->s;
+   stbi__uint32 j;
+   ptrdiff_t pitch = (ptrdiff_t) s->img_x * pp->out_n * (pp->z->depth == 16 ? 2 : 1);
+   STBI_NOTUSED(index);
+   if (s->flip) pitch = -pitch;
+   for (j=0; j < s->img_y; ++j) {
+      stbi_uc *raw, *cur = stbi__png_pipe_row(pp, j);
+      int avail;
+      stbi__mutex_lock(&pp->lock);
+      while (j >= pp->y && !pp->finished)
+         stbi__cond_wait(&pp->cond, &pp->lock);
+      avail = j < pp->y;
+      stbi__mutex_unlock(&pp->lock);
+      if (!avail) return; // the inflater gave up, and says why
+      raw = pp->ring + (size_t) (j % pp->slots) * pp->line_bytes;
+      if (!stbi__png_unfilter_row(cur, j ? cur - pitch : cur, raw+1, raw[0], j == 0, s->img_n, pp->out_n, s->img_x, pp->z->depth)) {
+         stbi__mutex_lock(&pp->lock);
+         pp->failed = 1;
+         pp->reason = stbi__g_failure_reason;
+         stbi__cond_broadcast(&pp->cond);
+         stbi__mutex_unlock(&pp->lock);
+         return;
+      }
+      if (j) stbi__png_pipe_finish_row(pp, j-1);
+      stbi__mutex_lock(&pp->lock);
+      pp->done = j+1;
+      stbi__cond_broadcast(&pp->cond);
+      stbi__mutex_unlock(&pp->lock);
+   }
+   stbi__png_pipe_finish_row(pp, s->img_y-1);
+}
+
+// zlib window flush: copy the inflated data into ring slots
+static int stbi__png_pipe_flush(void *user, stbi_uc *data, int len)
+{
+   stbi__png_pipe *pp = (stbi__png_pipe *) user;
+   stbi__uint32 img_y = pp->z->s->img_y;
+   while (len > 0 && pp->y < img_y) {
+      int k = pp->line_bytes - pp->have;
+      if (pp->have == 0) {
+         // wait for the worker to free the slot
+         int failed;
+         stbi__mutex_lock(&pp->lock);
+         while (pp->y - pp->done >= (stbi__uint32) pp->slots && !pp->failed)
+            stbi__cond_wait(&pp->cond, &pp->lock);
+         failed = pp->failed;
+         stbi__mutex_unlock(&pp->lock);
+         if (failed) return 0;
+      }
+      if (k > len) k = len;
+      memcpy(pp->ring + (size_t) (pp->y % pp->slots) * pp->line_bytes + pp->have, data, k);
+      pp->have += k;
+      data += k;
+      len  -= k;
+      if (pp->have == pp->line_bytes) {
+         pp->have = 0;
+         stbi__mutex_lock(&pp->lock);
+         ++pp->y;
+         stbi__cond_broadcast(&pp->cond);
+         stbi__mutex_unlock(&pp->lock);
+      }
+   }
+   // like the whole-image path, ignore any data past the last row
+   return 1;
+}
+
+// decode into z->out and set *piped, unless the image is too small to be
+// worth it or there is no second thread. returns 0 on error
+static int stbi__png_pipeline_image(stbi__png *z, stbi__uint32 ioff, int parse_header, int out_n, int color, int *piped)
+{
+   stbi__context *s = z->s;
+   int ok, bytes = (z->depth == 16 ? 2 : 1);
+   stbi__png_pipe pp;
+   stbi__parallel_job job;
+   stbi__thread worker;
+   stbi__zbuf a;
+   stbi_uc *mem;
+
+   *piped = 0;
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, z->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   pp.line_bytes = (int) (((s->img_n * s->img_x * z->depth) + 7) >> 3) + 1;
+   // below a few hundred KB, starting the thread costs more than it saves
+   if ((stbi__uint32) pp.line_bytes * s->img_y < (1 << 18) || stbi__load_threads(s) < 2) return 1;
+
+   // ring of about 128K (one window flush) but at least 8 rows, then the 128K inflate window
+   pp.slots = (1 << 17) / pp.line_bytes;
+   if (pp.slots < 8) pp.slots = 8;
+   if ((stbi__uint32) pp.slots > s->img_y) pp.slots = s->img_y;
+   z->out = (stbi_uc *) stbi__malloc_mad3(s->img_x, s->img_y, out_n * bytes, 0);
+   mem = (stbi_uc *) stbi__scratch_mad2(s->scratch, pp.slots, pp.line_bytes, 1 << 17);
+   if (!z->out || !mem) {
+      stbi__scratch_free(s->scratch, mem);
+      return stbi__err("outofmem", "Out of memory");
+   }
+   pp.z = z;
+   pp.ring = mem;
+   pp.have = 0;
+   pp.out_n = out_n;
+   pp.color = color;
+   pp.y = pp.done = 0;
+   pp.finished = pp.failed = 0;
+   pp.reason = NULL;
+   stbi__mutex_init(&pp.lock);
+   stbi__cond_init(&pp.cond);
+   job.func = stbi__png_pipe_unfilter;
+   job.user = &pp;
+   job.count = 1;
+   job.next = 0;
+   stbi__mutex_init(&job.lock);
+   if (!stbi__thread_start(&worker, &job)) {
+      // nothing has happened yet; decode the usual way
+      stbi__mutex_destroy(&job.lock);
+      stbi__cond_destroy(&pp.cond);
+      stbi__mutex_destroy(&pp.lock);
+      stbi__scratch_free(s->scratch, mem);
+      stbi__free(z->out); z->out = NULL;
+      return 1;
+   }
+
+   a.zbuffer = z->idata;
+   a.zbuffer_end = z->idata + ioff;
+   a.cache = stbi__png_zcache(s);
+   ok = stbi__do_zlib_window(&a, (char *) mem + (size_t) pp.slots * pp.line_bytes, 1 << 17, parse_header, stbi__png_pipe_flush, &pp);
+   stbi__mutex_lock(&pp.lock);
+   pp.finished = 1;
+   stbi__cond_broadcast(&pp.cond);
+   stbi__mutex_unlock(&pp.lock);
+   stbi__thread_join(worker);
+
+   if (pp.failed) {
+      stbi__g_failure_reason = pp.reason;
+      ok = 0;
+   } else if (ok && pp.y < s->img_y)
+      ok = stbi__err("not enough pixels","Corrupt PNG");
+   stbi__mutex_destroy(&job.lock);
+   stbi__cond_destroy(&pp.cond);
+   stbi__mutex_destroy(&pp.lock);
+   stbi__scratch_free(s->scratch, mem);
+   *piped = 1;
+   return ok;
+}
+#endif // STBI_THREADS
+
+// when the whole file is in memory, add up the run of IDAT chunks starting
+// with the current one (len bytes, not read yet) so they can be gathered
+// into a single allocation instead of a growing one
+static stbi__uint32 stbi__png_idat_total(stbi__context *s, stbi__uint32 len)
+{
+   stbi_uc *p = s->img_buffer;
+   stbi__uint64 total = len;
+   if (s->io.read) return len;
+   // this chunk's data and crc, then the next chunk's header
+   while ((stbi__uint64) (s->img_buffer_end - p) >= (stbi__uint64) len + 12) {
+      p += len + 4;
+      if (p[4] != 'I' || p[5] != 'D' || p[6] != 'A' || p[7] != 'T') break;
+      len = ((stbi__uint32) p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+      p += 8;
+      if ((stbi__uint64) (s->img_buffer_end - p) < len) break;
+      total += len;
+   }
+   return total > INT_MAX ? 0 : (stbi__uint32) total;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
    stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, piped=0;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->palette = NULL;
+   z->half = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5120,11 +9593,14 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
                stbi_uc *p;
-               if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
+               if (idata_limit == 0) {
+                  idata_limit = stbi__png_idat_total(s, c.length);
+                  if (idata_limit < 4096) idata_limit = 4096;
+               }
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__scratch_realloc(s->scratch, z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -5133,42 +9609,83 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
+            stbi__uint32 raw_len;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
+            if (s->stream && !interlace) {
+               stbi__png_stream ps;
+               ps.z = z;
+               ps.st = s->stream;
+               ps.req_comp = req_comp;
+               ps.color = color;
+               ps.has_trans = has_trans;
+               ps.tc = tc;
+               ps.tc16 = tc16;
+               ps.is_iphone = is_iphone;
+               ps.palette = palette;
+               ps.pal_img_n = pal_img_n;
+               ps.pal_out_n = req_comp >= 3 ? req_comp : pal_img_n;
+               if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+                  ps.out_n = s->img_n+1;
+               else
+                  ps.out_n = s->img_n;
+               if (!stbi__png_stream_image(&ps, ioff, !is_iphone)) return 0;
+               s->stream->done = 1;
+               stbi__scratch_free(s->scratch, z->idata); z->idata = NULL;
+               stbi__get32be(s);
+               return 1;
+            }
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            // half floats can be written directly unless the samples are
+            // still to be compared (tRNS) or converted to another format
+            z->half = s->half && z->depth == 16 && !has_trans && (!req_comp || req_comp == s->img_out_n);
+            #ifdef STBI_THREADS
+            if (!interlace && !stbi__png_pipeline_image(z, ioff, !is_iphone, s->img_out_n, color, &piped)) return 0;
+            #endif
+            if (!piped) {
+               // the header gives the exact inflated size, so decode straight
+               // into one buffer of that size; data past the last row is ignored
+               int n;
+               raw_len = stbi__png_raw_size(s->img_x, s->img_y, s->img_n, z->depth, interlace);
+               if (raw_len == 0) return stbi__err("too large", "Very large image (corrupt?)");
+               z->expanded = (stbi_uc *) stbi__scratch_malloc(s->scratch, raw_len);
+               if (z->expanded == NULL) return stbi__err("outofmem", "Out of memory");
+               n = stbi__zlib_decode_into((char *) z->expanded, (int) raw_len, (char *) z->idata, ioff, !is_iphone, stbi__png_zcache(s));
+               if (n < 0) return 0; // zlib should set error
+               raw_len = (stbi__uint32) n;
+               stbi__scratch_free(s->scratch, z->idata); z->idata = NULL;
+               if (pal_img_n) {
+                  z->palette = palette;
+                  z->pal_n = req_comp >= 3 ? req_comp : pal_img_n;
+               }
+               if (!stbi__create_png_image(z, z->expanded, raw_len, z->palette ? z->pal_n : s->img_out_n, z->depth, color, interlace)) return 0;
+            }
+            stbi__scratch_free(s->scratch, z->idata); z->idata = NULL;
             if (has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16((stbi__uint16 *) z->out, s->img_x * s->img_y, tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
+            if (is_iphone && s->opt.convert_iphone_png && s->img_out_n > 2)
+               stbi__de_iphone(z->out, s->img_x * s->img_y, s->img_out_n, s->opt.unpremultiply);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!z->palette && !stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
                   return 0;
             } else if (has_trans) {
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__scratch_free(s->scratch, z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5200,13 +9717,16 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
 {
    void *result=NULL;
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-   if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
+   // when the rows were streamed out there's no image left to return
+   if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp) && p->out) {
       if (p->depth <= 8)
          ri->bits_per_channel = 8;
       else if (p->depth == 16)
          ri->bits_per_channel = 16;
       else
          return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
+      ri->half = p->half;
+      ri->flipped = p->s->flip;
       result = p->out;
       p->out = NULL;
       if (req_comp && req_comp != p->s->img_out_n) {
@@ -5221,9 +9741,9 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->out);      p->out      = NULL;
+   stbi__scratch_free(p->s->scratch, p->expanded); p->expanded = NULL;
+   stbi__scratch_free(p->s->scratch, p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -5472,14 +9992,16 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    int psize=0,i,j,width;
    int flip_vertically, pad, target;
    stbi__bmp_data info;
-   STBI_NOTUSED(ri);
 
    info.all_a = 255;
    if (stbi__bmp_parse_header(s, &info) == NULL)
       return NULL; // error code already set
 
-   flip_vertically = ((int) s->img_y) > 0;
+   // rows are stored bottom-up unless the height is negative; either way
+   // they go straight to where they belong
+   flip_vertically = (((int) s->img_y) > 0) != (s->flip != 0);
    s->img_y = abs((int) s->img_y);
+   ri->flipped = s->flip;
 
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
@@ -5520,7 +10042,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5532,11 +10054,12 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
             int bit_offset = 7, v = stbi__get8(s);
+            z = (flip_vertically ? (int) s->img_y-1 - j : j) * (int) s->img_x * target;
             for (i=0; i < (int) s->img_x; ++i) {
                int color = (v>>bit_offset)&0x1;
                out[z++] = pal[color][0];
@@ -5553,6 +10076,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
          }
       } else {
          for (j=0; j < (int) s->img_y; ++j) {
+            z = (flip_vertically ? (int) s->img_y-1 - j : j) * (int) s->img_x * target;
             for (i=0; i < (int) s->img_x; i += 2) {
                int v=stbi__get8(s),v2=0;
                if (info.bpp == 4) {
@@ -5589,15 +10113,16 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
          bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
       }
       for (j=0; j < (int) s->img_y; ++j) {
+         z = (flip_vertically ? (int) s->img_y-1 - j : j) * (int) s->img_x * target;
          if (easy) {
             for (i=0; i < (int) s->img_x; ++i) {
                unsigned char a;
@@ -5631,17 +10156,6 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       for (i=4*s->img_x*s->img_y-1; i >= 0; i -= 4)
          out[i] = 255;
 
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i]; p1[i] = p2[i]; p2[i] = t;
-         }
-      }
-   }
-
    if (req_comp && req_comp != target) {
       out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
@@ -5816,7 +10330,8 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    int RLE_count = 0;
    int RLE_repeating = 0;
    int read_next_pixel = 1;
-   STBI_NOTUSED(ri);
+   unsigned char *tga_out = NULL; // where the next pixel goes
+   int row_left = 0;              // pixels left in its row
    STBI_NOTUSED(tga_x_origin); // @TODO
    STBI_NOTUSED(tga_y_origin); // @TODO
 
@@ -5830,6 +10345,10 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       tga_is_RLE = 1;
    }
    tga_inverted = 1 - ((tga_inverted >> 5) & 1);
+   // rows are stored bottom-up unless bit 5 is set; either way they go
+   // straight to where they belong
+   if (s->flip) tga_inverted = !tga_inverted;
+   ri->flipped = s->flip;
 
    //   If I'm paletted, then I'll use the number of bits from the palette
    if ( tga_indexed ) tga_comp = stbi__tga_get_comp(tga_palette_bits, 0, &tga_rgb16);
@@ -5863,7 +10382,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       if ( tga_indexed)
       {
          if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("bad palette", "Corrupt TGA");
          }
 
@@ -5872,7 +10391,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5883,14 +10402,21 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
       //   load the data
       for (i=0; i < tga_width * tga_height; ++i)
       {
+         if ( row_left == 0 )
+         {
+            int row = i / tga_width;
+            tga_out = tga_data + (tga_inverted ? tga_height - row - 1 : row) * tga_width * tga_comp;
+            row_left = tga_width;
+         }
+         --row_left;
          //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
          if ( tga_is_RLE )
          {
@@ -5940,32 +10466,16 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
 
          // copy data
          for (j = 0; j < tga_comp; ++j)
-           tga_data[i*tga_comp+j] = raw_data[j];
+           tga_out[j] = raw_data[j];
+         tga_out += tga_comp;
 
          //   in case we're in RLE mode, keep counting down
          --RLE_count;
       }
-      //   do I need to invert the image?
-      if ( tga_inverted )
-      {
-         for (j = 0; j*2 < tga_height; ++j)
-         {
-            int index1 = j * tga_width * tga_comp;
-            int index2 = (tga_height - 1 - j) * tga_width * tga_comp;
-            for (i = tga_width * tga_comp; i > 0; --i)
-            {
-               unsigned char temp = tga_data[index1];
-               tga_data[index1] = tga_data[index2];
-               tga_data[index2] = temp;
-               ++index1;
-               ++index2;
-            }
-         }
-      }
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
@@ -6157,7 +10667,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6449,7 +10959,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -6497,6 +11007,8 @@ typedef struct
    int cur_x, cur_y;
    int line_size;
    int delay;
+   int frames;                   // frames decoded so far
+   stbi_uc string[8192];         // one code's pixels, gathered back to front
 } stbi__gif;
 
 static int stbi__gif_test_raw(stbi__context *s)
@@ -6563,49 +11075,59 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!g) return stbi__err("outofmem", "Out of memory");
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
 static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
 {
-   stbi_uc *p, *c;
-   int idx;
+   stbi_uc *p, *c, *str;
+   int idx, n;
 
-   // recurse to decode the prefixes, since the linked-list is backwards,
-   // and working backwards through an interleaved image would be nasty
-   if (g->codes[code].prefix >= 0)
-      stbi__out_gif_code(g, g->codes[code].prefix);
+   // the linked list runs from the last pixel of the string back to its
+   // first, so gather the suffixes and emit them in reverse. in a valid
+   // stream a chain can't be longer than the code table; corrupt ones can
+   // make it loop, so stop there
+   str = g->string + sizeof(g->string);
+   n = 0;
+   for (;;) {
+      *--str = g->codes[code].suffix;
+      ++n;
+      if (g->codes[code].prefix < 0 || n == (int) sizeof(g->string)) break;
+      code = (stbi__uint16) g->codes[code].prefix;
+   }
 
-   if (g->cur_y >= g->max_y) return;
+   for (; n > 0; --n, ++str) {
+      if (g->cur_y >= g->max_y) return;
 
-   idx = g->cur_x + g->cur_y;
-   p = &g->out[idx];
-   g->history[idx / 4] = 1;
+      idx = g->cur_x + g->cur_y;
+      p = &g->out[idx];
+      g->history[idx / 4] = 1;
 
-   c = &g->color_table[g->codes[code].suffix * 4];
-   if (c[3] > 128) { // don't render transparent pixels;
-      p[0] = c[2];
-      p[1] = c[1];
-      p[2] = c[0];
-      p[3] = c[3];
-   }
-   g->cur_x += 4;
+      c = &g->color_table[*str * 4];
+      if (c[3] > 128) { // don't render transparent pixels;
+         p[0] = c[2];
+         p[1] = c[1];
+         p[2] = c[0];
+         p[3] = c[3];
+      }
+      g->cur_x += 4;
 
-   if (g->cur_x >= g->max_x) {
-      g->cur_x = g->start_x;
-      g->cur_y += g->step;
+      if (g->cur_x >= g->max_x) {
+         g->cur_x = g->start_x;
+         g->cur_y += g->step;
 
-      while (g->cur_y >= g->max_y && g->parse > 0) {
-         g->step = (1 << g->parse) * g->line_size;
-         g->cur_y = g->start_y + (g->step >> 1);
-         --g->parse;
+         while (g->cur_y >= g->max_y && g->parse > 0) {
+            g->step = (1 << g->parse) * g->line_size;
+            g->cur_y = g->start_y + (g->step >> 1);
+            --g->parse;
+         }
       }
    }
 }
@@ -6695,6 +11217,30 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
    }
 }
 
+// read the header and allocate the canvas; the caller frees g->out,
+// g->background and g->history whether or not this succeeds
+static int stbi__gif_begin(stbi__context *s, stbi__gif *g, int *comp)
+{
+   int pcount;
+   if (!stbi__gif_header(s, g, comp,0)) return 0; // stbi__g_failure_reason set by stbi__gif_header
+   if (!stbi__mad3sizes_valid(4, g->w, g->h, 0))
+      return stbi__err("too large", "GIF image is too large");
+   pcount = g->w * g->h;
+   g->out = (stbi_uc *) stbi__malloc(4 * pcount);
+   g->background = (stbi_uc *) stbi__malloc(4 * pcount);
+   g->history = (stbi_uc *) stbi__malloc(pcount);
+   if (!g->out || !g->background || !g->history)
+      return stbi__err("outofmem", "Out of memory");
+
+   // image is treated as "transparent" at the start - ie, nothing overwrites the current background;
+   // background colour is only used for pixels that are not rendered first frame, after that "background"
+   // color refers to the color that was there the previous frame.
+   memset(g->out, 0x00, 4 * pcount);
+   memset(g->background, 0x00, 4 * pcount); // state of the background (starts transparent)
+   memset(g->history, 0x00, pcount);        // pixels that were affected previous frame
+   return 1;
+}
+
 // this function is designed to support animated gifs, although stb_image doesn't support it
 // two back is the image from two frames ago, used for a very specific disposal format
 static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp, stbi_uc *two_back)
@@ -6705,27 +11251,11 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
    int pcount;
    STBI_NOTUSED(req_comp);
 
+   if (g->out == 0 && !stbi__gif_begin(s, g, comp)) return 0;
+
    // on first frame, any non-written pixels get the background colour (non-transparent)
-   first_frame = 0;
-   if (g->out == 0) {
-      if (!stbi__gif_header(s, g, comp,0)) return 0; // stbi__g_failure_reason set by stbi__gif_header
-      if (!stbi__mad3sizes_valid(4, g->w, g->h, 0))
-         return stbi__errpuc("too large", "GIF image is too large");
-      pcount = g->w * g->h;
-      g->out = (stbi_uc *) stbi__malloc(4 * pcount);
-      g->background = (stbi_uc *) stbi__malloc(4 * pcount);
-      g->history = (stbi_uc *) stbi__malloc(pcount);
-      if (!g->out || !g->background || !g->history)
-         return stbi__errpuc("outofmem", "Out of memory");
-
-      // image is treated as "transparent" at the start - ie, nothing overwrites the current background;
-      // background colour is only used for pixels that are not rendered first frame, after that "background"
-      // color refers to the color that was there the previous frame.
-      memset(g->out, 0x00, 4 * pcount);
-      memset(g->background, 0x00, 4 * pcount); // state of the background (starts transparent)
-      memset(g->history, 0x00, pcount);        // pixels that were affected previous frame
-      first_frame = 1;
-   } else {
+   first_frame = g->frames == 0;
+   if (!first_frame) {
       // second frame - how do we dispose of the previous one?
       dispose = (g->eflags & 0x1C) >> 2;
       pcount = g->w * g->h;
@@ -6824,6 +11354,7 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
                }
             }
 
+            ++g->frames;
             return o;
          }
 
@@ -6873,12 +11404,12 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
 static void *stbi__load_gif_main_outofmem(stbi__gif *g, stbi_uc *out, int **delays)
 {
-   STBI_FREE(g->out);
-   STBI_FREE(g->history);
-   STBI_FREE(g->background);
+   stbi__free(g->out);
+   stbi__free(g->history);
+   stbi__free(g->background);
 
-   if (out) STBI_FREE(out);
-   if (delays && *delays) STBI_FREE(*delays);
+   if (out) stbi__free(out);
+   if (delays && *delays) stbi__free(*delays);
    return stbi__errpuc("outofmem", "Out of memory");
 }
 
@@ -6913,7 +11444,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc_sized( out, out_size, layers * stride );
                if (!tmp)
                   return stbi__load_gif_main_outofmem(&g, out, delays);
                else {
@@ -6922,7 +11453,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                }
 
                if (delays) {
-                  int *new_delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  int *new_delays = (int*) stbi__realloc_sized( *delays, delays_size, sizeof(int) * layers );
                   if (!new_delays)
                      return stbi__load_gif_main_outofmem(&g, out, delays);
                   *delays = new_delays;
@@ -6942,7 +11473,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
             if (layers >= 2) {
-               two_back = out - 2 * stride;
+               two_back = out + (layers - 2) * stride;
             }
 
             if (delays) {
@@ -6952,9 +11483,9 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(g.out);
+      stbi__free(g.history);
+      stbi__free(g.background);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
@@ -6986,16 +11517,144 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
          u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
    } else if (g.out) {
       // if there was an error and we allocated an image buffer, free it!
-      STBI_FREE(g.out);
+      stbi__free(g.out);
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(g.history);
+   stbi__free(g.background);
 
    return u;
 }
 
+struct stbi__gif_stream
+{
+   stbi__context s;
+   stbi__gif g;
+   stbi_uc *back[2];    // the last two frames composited, for "restore previous" disposal
+   stbi_uc *frame;      // converted and/or flipped copy of g.out, if that's what was asked for
+   int req_comp, flip, done;
+};
+
+STBIDEF void stbi_gif_stream_close(stbi_gif_stream *gs)
+{
+   if (gs) {
+      stbi__free(gs->g.out);
+      stbi__free(gs->g.history);
+      stbi__free(gs->g.background);
+      stbi__free(gs->back[0]);
+      stbi__free(gs->back[1]);
+      stbi__free(gs->frame);
+      stbi__free(gs);
+   }
+}
+
+static stbi_gif_stream *stbi__gif_stream_open(stbi_gif_stream *gs, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__gif *g = &gs->g;
+   int pcount;
+
+   // the stream outlives this call and may move to other threads, so it
+   // can't hold on to this thread's cache (GIF frames use no scratch buffers)
+   gs->s.scratch = NULL;
+   if (req_comp < 0 || req_comp > 4) {
+      stbi_gif_stream_close(gs);
+      return (stbi_gif_stream *) stbi__errpuc("bad req_comp", "Internal error");
+   }
+   if (!stbi__gif_test(&gs->s)) {
+      stbi_gif_stream_close(gs);
+      return (stbi_gif_stream *) stbi__errpuc("not GIF", "Image was not as a gif type.");
+   }
+   if (!stbi__gif_begin(&gs->s, g, comp)) {
+      stbi_gif_stream_close(gs);
+      return NULL;
+   }
+
+   gs->req_comp = req_comp ? req_comp : 4;
+   gs->flip = gs->s.opt.flip_vertically;
+   pcount = g->w * g->h;
+   gs->back[0] = (stbi_uc *) stbi__malloc(4 * pcount);
+   gs->back[1] = (stbi_uc *) stbi__malloc(4 * pcount);
+   if (gs->req_comp != 4 || gs->flip)
+      gs->frame = (stbi_uc *) stbi__malloc_mad3(gs->req_comp, g->w, g->h, 0);
+   if (!gs->back[0] || !gs->back[1] || ((gs->req_comp != 4 || gs->flip) && !gs->frame)) {
+      stbi_gif_stream_close(gs);
+      return (stbi_gif_stream *) stbi__errpuc("outofmem", "Out of memory");
+   }
+
+   *x = g->w;
+   *y = g->h;
+   return gs;
+}
+
+static stbi_gif_stream *stbi__gif_stream_alloc(void)
+{
+   stbi_gif_stream *gs = (stbi_gif_stream *) stbi__malloc(sizeof(*gs));
+   if (!gs) return (stbi_gif_stream *) stbi__errpuc("outofmem", "Out of memory");
+   memset(gs, 0, sizeof(*gs));
+   return gs;
+}
+
+STBIDEF stbi_gif_stream *stbi_gif_stream_open_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_stream *gs = stbi__gif_stream_alloc();
+   if (!gs) return NULL;
+   stbi__start_mem(&gs->s,buffer,len);
+   return stbi__gif_stream_open(gs,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_gif_stream *stbi_gif_stream_open_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_stream *gs = stbi__gif_stream_alloc();
+   if (!gs) return NULL;
+   stbi__start_callbacks(&gs->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__gif_stream_open(gs,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_stream *stbi_gif_stream_open_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_stream *gs = stbi__gif_stream_alloc();
+   if (!gs) return NULL;
+   stbi__start_file(&gs->s,f);
+   return stbi__gif_stream_open(gs,x,y,comp,req_comp);
+}
+#endif
+
+STBIDEF stbi_uc const *stbi_gif_stream_next(stbi_gif_stream *gs, int *delay)
+{
+   stbi__gif *g = &gs->g;
+   stbi_uc *u, *two_back;
+   int j, stride;
+
+   if (gs->done) return NULL;
+
+   // frame n is disposed of against frame n-2, the same one
+   // stbi_load_gif_from_memory would have kept in its output
+   two_back = g->frames >= 2 ? gs->back[g->frames & 1] : NULL;
+   u = stbi__gif_load_next(&gs->s, g, NULL, 0, two_back);
+   if (u == (stbi_uc *) &gs->s) u = 0;  // end of animated gif marker
+   if (!u) {
+      gs->done = 1;
+      return NULL;
+   }
+
+   stride = g->w * 4;
+   memcpy(gs->back[(g->frames - 1) & 1], u, stride * g->h);
+   if (delay) *delay = g->delay;
+
+   if (!gs->frame) return u;
+   for (j=0; j < g->h; ++j) {
+      stbi_uc *src = u + (gs->flip ? g->h - 1 - j : j) * stride;
+      stbi_uc *dest = gs->frame + (size_t) j * g->w * gs->req_comp;
+      if (gs->req_comp == 4)
+         memcpy(dest, src, stride);
+      else
+         stbi__convert_row(src, dest, 4, gs->req_comp, g->w);
+   }
+   return gs->frame;
+}
+
 static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
@@ -7077,19 +11736,201 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
-static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+// non-negative r,g,b in GL_RGB9_E5 layout: this is float3_to_rgb9e5 from
+// EXT_texture_shared_exponent, which clamps to the largest representable
+// value (65408)
+static stbi__uint32 stbi__float3_to_rgb9e5(float r, float g, float b)
+{
+   float m, scale;
+   stbi__uint32 u;
+   int e;
+   if (r > 65408.0f) r = 65408.0f;
+   if (g > 65408.0f) g = 65408.0f;
+   if (b > 65408.0f) b = 65408.0f;
+   m = r > g ? r : g;
+   m = m > b ? m : b;
+   // shared exponent from floor(log2(m)), at least -16, biased by 15 and
+   // one more for the 9-bit mantissas; scale is 2^(9 - exponent)
+   memcpy(&u, &m, 4);
+   e = (int) (u >> 23) - 111;
+   if (e < 0) e = 0;
+   u = (stbi__uint32) (151 - e) << 23;
+   memcpy(&scale, &u, 4);
+   if ((int) (m * scale + 0.5f) == 512) {
+      ++e;
+      scale *= 0.5f;
+   }
+   return (stbi__uint32) (int) (r * scale + 0.5f) | (stbi__uint32) (int) (g * scale + 0.5f) << 9 |
+          (stbi__uint32) (int) (b * scale + 0.5f) << 18 | (stbi__uint32) e << 27;
+}
+
+#ifdef STBI_SSE2
+// RGBE to float for 4 pixels in 32-bit lanes, exactly as stbi__hdr_convert:
+// m * 2^(e-136) is a normal float times m when e >= 10; below that the
+// result is denormal and is scaled in two steps. e == 0 is black
+static void stbi__hdr_rgbe_sse2(__m128i r, __m128i g, __m128i b, __m128i e, __m128 *fr, __m128 *fg, __m128 *fb)
+{
+   __m128i small = _mm_cmplt_epi32(e, _mm_set1_epi32(10));
+   __m128i hi = _mm_slli_epi32(_mm_sub_epi32(e, _mm_set1_epi32(9)), 23);
+   __m128i lo = _mm_slli_epi32(_mm_add_epi32(e, _mm_set1_epi32(15)), 23);
+   __m128 f1 = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(small, lo), _mm_andnot_si128(small, hi)));
+   __m128 f2 = _mm_or_ps(_mm_and_ps(_mm_castsi128_ps(small), _mm_set1_ps(1.0f / 16777216.0f)),
+                         _mm_andnot_ps(_mm_castsi128_ps(small), _mm_set1_ps(1.0f)));
+   f2 = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(e, _mm_setzero_si128())), f2);
+   *fr = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(r), f1), f2);
+   *fg = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(g), f1), f2);
+   *fb = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(b), f1), f2);
+}
+
+// stbi__float3_to_rgb9e5 for 4 pixels
+static __m128i stbi__float3_to_rgb9e5_sse2(__m128 r, __m128 g, __m128 b)
+{
+   __m128 lim = _mm_set1_ps(65408.0f), half = _mm_set1_ps(0.5f), m, scale;
+   __m128i e, wrap;
+   r = _mm_min_ps(r, lim);
+   g = _mm_min_ps(g, lim);
+   b = _mm_min_ps(b, lim);
+   m = _mm_max_ps(_mm_max_ps(r, g), b);
+   e = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(m), 23), _mm_set1_epi32(111));
+   e = _mm_andnot_si128(_mm_srai_epi32(e, 31), e);
+   scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(151), e), 23));
+   wrap = _mm_cmpeq_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(m, scale), half)), _mm_set1_epi32(512));
+   e = _mm_sub_epi32(e, wrap);
+   scale = _mm_mul_ps(scale, _mm_or_ps(_mm_and_ps(_mm_castsi128_ps(wrap), half), _mm_andnot_ps(_mm_castsi128_ps(wrap), _mm_set1_ps(1.0f))));
+   return _mm_or_si128(_mm_or_si128(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, scale), half)),
+                                    _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(g, scale), half)), 9)),
+                       _mm_or_si128(_mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half)), 18),
+                                    _mm_slli_epi32(e, 27)));
+}
+#endif
+
+// convert a row of RGBE pixels, stored as four planes of width bytes (R, G,
+// B, E), to floats with req_comp channels, or (always RGB) halves or rgb9e5
+static void stbi__hdr_convert_row(void *output, stbi_uc *planes, int width, int format, int req_comp)
+{
+   int i = 0;
+   #ifdef STBI_SSE2
+   if (stbi__sse2_available() && (format != STBI_hdr_float || req_comp >= 3)) {
+      __m128i zero = _mm_setzero_si128();
+      // halves are stored 8 bytes a pixel, overlapping the next one, so
+      // leave the last pixel to the scalar loop
+      for (; i + 16 < width; i += 16) {
+         __m128i r16 = _mm_loadu_si128((__m128i *) (planes + i));
+         __m128i g16 = _mm_loadu_si128((__m128i *) (planes + width + i));
+         __m128i b16 = _mm_loadu_si128((__m128i *) (planes + 2*width + i));
+         __m128i e16 = _mm_loadu_si128((__m128i *) (planes + 3*width + i));
+         int k;
+         for (k=0; k < 4; ++k) {
+            __m128i r8, g8, b8, e8;
+            __m128 fr, fg, fb, fa;
+            int p = i + k*4;
+            // widen bytes 4k..4k+3 of each plane to 32 bits
+            if (k < 2) {
+               r8 = _mm_unpacklo_epi8(r16, zero); g8 = _mm_unpacklo_epi8(g16, zero);
+               b8 = _mm_unpacklo_epi8(b16, zero); e8 = _mm_unpacklo_epi8(e16, zero);
+            } else {
+               r8 = _mm_unpackhi_epi8(r16, zero); g8 = _mm_unpackhi_epi8(g16, zero);
+               b8 = _mm_unpackhi_epi8(b16, zero); e8 = _mm_unpackhi_epi8(e16, zero);
+            }
+            if (k & 1) {
+               r8 = _mm_unpackhi_epi16(r8, zero); g8 = _mm_unpackhi_epi16(g8, zero);
+               b8 = _mm_unpackhi_epi16(b8, zero); e8 = _mm_unpackhi_epi16(e8, zero);
+            } else {
+               r8 = _mm_unpacklo_epi16(r8, zero); g8 = _mm_unpacklo_epi16(g8, zero);
+               b8 = _mm_unpacklo_epi16(b8, zero); e8 = _mm_unpacklo_epi16(e8, zero);
+            }
+            stbi__hdr_rgbe_sse2(r8, g8, b8, e8, &fr, &fg, &fb);
+            if (format == STBI_hdr_float) {
+               float *o = (float *) output + p * req_comp;
+               fa = _mm_set1_ps(1.0f);
+               _MM_TRANSPOSE4_PS(fr, fg, fb, fa);
+               if (req_comp == 4) {
+                  _mm_storeu_ps(o     , fr);
+                  _mm_storeu_ps(o +  4, fg);
+                  _mm_storeu_ps(o +  8, fb);
+                  _mm_storeu_ps(o + 12, fa);
+               } else {
+                  // drop the alphas: r0g0b0r1 g1b1r2g2 b2r3g3b3
+                  __m128 t0 = _mm_shuffle_ps(fr, fg, _MM_SHUFFLE(0,0,2,2));
+                  __m128 t2 = _mm_shuffle_ps(fb, fa, _MM_SHUFFLE(0,0,2,2));
+                  _mm_storeu_ps(o    , _mm_shuffle_ps(fr, t0, _MM_SHUFFLE(2,0,1,0)));
+                  _mm_storeu_ps(o + 4, _mm_shuffle_ps(fg, fb, _MM_SHUFFLE(1,0,2,1)));
+                  _mm_storeu_ps(o + 8, _mm_shuffle_ps(t2, fa, _MM_SHUFFLE(2,1,2,0)));
+               }
+            } else if (format == STBI_hdr_half) {
+               __m128 lim = _mm_set1_ps(65504.0f);
+               stbi_uc *o = (stbi_uc *) output + p * 6;
+               __m128i rg = _mm_or_si128(stbi__float_to_half_sse2(_mm_min_ps(fr, lim)),
+                                         _mm_slli_epi32(stbi__float_to_half_sse2(_mm_min_ps(fg, lim)), 16));
+               __m128i hb = stbi__float_to_half_sse2(_mm_min_ps(fb, lim));
+               __m128i lo = _mm_unpacklo_epi32(rg, hb), hi = _mm_unpackhi_epi32(rg, hb);
+               _mm_storel_epi64((__m128i *) (o     ), lo);
+               _mm_storel_epi64((__m128i *) (o +  6), _mm_srli_si128(lo, 8));
+               _mm_storel_epi64((__m128i *) (o + 12), hi);
+               _mm_storel_epi64((__m128i *) (o + 18), _mm_srli_si128(hi, 8));
+            } else {
+               _mm_storeu_si128((__m128i *) ((stbi__uint32 *) output + p), stbi__float3_to_rgb9e5_sse2(fr, fg, fb));
+            }
+         }
+      }
+   }
+   #endif
+   for (; i < width; ++i) {
+      stbi_uc rgbe[4];
+      float f[4];
+      rgbe[0] = planes[i];
+      rgbe[1] = planes[width + i];
+      rgbe[2] = planes[2*width + i];
+      rgbe[3] = planes[3*width + i];
+      if (format == STBI_hdr_float) {
+         stbi__hdr_convert((float *) output + i * req_comp, rgbe, req_comp);
+      } else if (format == STBI_hdr_half) {
+         stbi__uint16 *o = (stbi__uint16 *) output + i * 3;
+         int c;
+         stbi__hdr_convert(f, rgbe, 3);
+         for (c=0; c < 3; ++c)
+            o[c] = stbi__float_to_half(f[c] < 65504.0f ? f[c] : 65504.0f);
+      } else {
+         stbi__hdr_convert(f, rgbe, 3);
+         ((stbi__uint32 *) output)[i] = stbi__float3_to_rgb9e5(f[0], f[1], f[2]);
+      }
+   }
+}
+
+// n calls to stbi__get8, a buffer at a time: past the end of the data this
+// reads zeros
+static void stbi__hdr_getn(stbi__context *s, stbi_uc *buffer, int n)
+{
+   while (n > 0) {
+      int k = (int) (s->img_buffer_end - s->img_buffer);
+      if (k <= 0) {
+         if (!s->read_from_callbacks) {
+            memset(buffer, 0, n);
+            return;
+         }
+         stbi__refill_buffer(s);
+         continue;
+      }
+      if (k > n) k = n;
+      memcpy(buffer, s->img_buffer, k);
+      s->img_buffer += k;
+      buffer += k;
+      n -= k;
+   }
+}
+
+static void *stbi__hdr_decode(stbi__context *s, int *x, int *y, int *comp, int req_comp, int format)
 {
    char buffer[STBI__HDR_BUFLEN];
    char *token;
    int valid = 0;
-   int width, height;
-   stbi_uc *scanline;
-   float *hdr_data;
-   int len;
+   int width, height, pixel_bytes;
+   stbi_uc *scanline, *planes;
+   stbi_uc *hdr_data;
+   int len, rle, start;
    unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   int i, j, k, c1,c2;
    const char *headerToken;
-   STBI_NOTUSED(ri);
 
    // Check identifier
    headerToken = stbi__hdr_gettoken(s,buffer);
@@ -7124,90 +11965,115 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
 
    if (comp) *comp = 3;
    if (req_comp == 0) req_comp = 3;
+   pixel_bytes = format == STBI_hdr_float ? req_comp * (int) sizeof(float) : format == STBI_hdr_half ? 6 : 4;
 
-   if (!stbi__mad4sizes_valid(width, height, req_comp, sizeof(float), 0))
+   if (!stbi__mad3sizes_valid(width, height, pixel_bytes, 0))
       return stbi__errpf("too large", "HDR image is too large");
 
    // Read data
-   hdr_data = (float *) stbi__malloc_mad4(width, height, req_comp, sizeof(float), 0);
-   if (!hdr_data)
+   hdr_data = (stbi_uc *) stbi__malloc_mad3(width, height, pixel_bytes, 0);
+   // a row as stored in the file, then as four planes for stbi__hdr_convert_row
+   scanline = (stbi_uc *) stbi__malloc_mad2(width, 8, 0);
+   if (!hdr_data || !scanline) {
+      stbi__free(hdr_data);
+      stbi__free(scanline);
       return stbi__errpf("outofmem", "Out of memory");
+   }
+   planes = scanline + width * 4;
 
    // Load image data
-   // image data is stored as some number of sca
-   if ( width < 8 || width >= 32768) {
-      // Read flat data
-      for (j=0; j < height; ++j) {
-         for (i=0; i < width; ++i) {
-            stbi_uc rgbe[4];
-           main_decode_loop:
-            stbi__getn(s, rgbe, 4);
-            stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
-         }
-      }
-   } else {
-      // Read RLE-encoded data
-      scanline = NULL;
-
-      for (j = 0; j < height; ++j) {
+   // image data is stored as some number of scanlines, each either flat
+   // RGBE pixels or run-length encoded one component at a time
+   rle = width >= 8 && width < 32768;
+   start = 0;
+   for (j = 0; j < height; ++j) {
+      if (rle) {
          c1 = stbi__get8(s);
          c2 = stbi__get8(s);
          len = stbi__get8(s);
          if (c1 != 2 || c2 != 2 || (len & 0x80)) {
             // not run-length encoded, so we have to actually use THIS data as a decoded
-            // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
-            stbi_uc rgbe[4];
-            rgbe[0] = (stbi_uc) c1;
-            rgbe[1] = (stbi_uc) c2;
-            rgbe[2] = (stbi_uc) len;
-            rgbe[3] = (stbi_uc) stbi__get8(s);
-            stbi__hdr_convert(hdr_data, rgbe, req_comp);
-            i = 1;
-            j = 0;
-            STBI_FREE(scanline);
-            goto main_decode_loop; // yes, this makes no sense
-         }
-         len <<= 8;
-         len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
-         if (scanline == NULL) {
-            scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
-            if (!scanline) {
-               STBI_FREE(hdr_data);
-               return stbi__errpf("outofmem", "Out of memory");
-            }
-         }
-
-         for (k = 0; k < 4; ++k) {
-            int nleft;
-            i = 0;
-            while ((nleft = width - i) > 0) {
-               count = stbi__get8(s);
-               if (count > 128) {
-                  // Run
-                  value = stbi__get8(s);
-                  count -= 128;
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
-               } else {
-                  // Dump
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = stbi__get8(s);
+            // pixel (note this can't be a valid pixel--one of RGB must be >= 128), and
+            // read the whole image as flat data, starting over at the top
+            scanline[0] = (stbi_uc) c1;
+            scanline[1] = (stbi_uc) c2;
+            scanline[2] = (stbi_uc) len;
+            scanline[3] = (stbi_uc) stbi__get8(s);
+            rle = 0;
+            start = 1;
+            j = 0; // yes, this makes no sense
+         } else {
+            len <<= 8;
+            len |= stbi__get8(s);
+            if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+
+            for (k = 0; k < 4; ++k) {
+               stbi_uc *plane = planes + k * width;
+               int nleft;
+               i = 0;
+               if (s->img_buffer_end - s->img_buffer >= 2 * width) {
+                  // no code can take more than 2 bytes per pixel it covers,
+                  // so the whole plane is in the buffer: parse it in place
+                  stbi_uc *p = s->img_buffer;
+                  while ((nleft = width - i) > 0) {
+                     count = *p++;
+                     if (count > 128) {
+                        count -= 128;
+                        if (count > nleft) break;
+                        memset(plane + i, *p++, count);
+                     } else {
+                        if (count > nleft || count == 0) break;
+                        memcpy(plane + i, p, count);
+                        p += count;
+                     }
+                     i += count;
+                  }
+                  s->img_buffer = p;
+                  if (i < width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+               }
+               while ((nleft = width - i) > 0) {
+                  count = stbi__get8(s);
+                  if (count > 128) {
+                     // Run
+                     value = stbi__get8(s);
+                     count -= 128;
+                     if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                     memset(plane + i, value, count);
+                  } else {
+                     // Dump
+                     // (an empty one would never advance, so reject it too)
+                     if (count > nleft || count == 0) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                     stbi__hdr_getn(s, plane + i, count);
+                  }
+                  i += count;
                }
             }
          }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
       }
-      if (scanline)
-         STBI_FREE(scanline);
+      if (!rle) {
+         // Read flat data
+         stbi__hdr_getn(s, scanline + start * 4, (width - start) * 4);
+         start = 0;
+         for (i=0; i < width; ++i) {
+            planes[i          ] = scanline[i*4 + 0];
+            planes[i + width  ] = scanline[i*4 + 1];
+            planes[i + width*2] = scanline[i*4 + 2];
+            planes[i + width*3] = scanline[i*4 + 3];
+         }
+      }
+      stbi__hdr_convert_row(hdr_data + (size_t) (s->flip ? height-1 - j : j) * width * pixel_bytes, planes, width, format, req_comp);
    }
+   stbi__free(scanline);
 
    return hdr_data;
 }
 
+static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   ri->flipped = s->flip;
+   return (float *) stbi__hdr_decode(s, x, y, comp, req_comp, STBI_hdr_float);
+}
+
 static int stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp)
 {
    char buffer[STBI__HDR_BUFLEN];
@@ -7251,6 +12117,64 @@ static int stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp)
    *comp = 3;
    return 1;
 }
+
+static void *stbi__load_hdr_main(stbi__context *s, int *x, int *y, int format)
+{
+   if (format < STBI_hdr_float || format > STBI_hdr_rgb9e5)
+      return stbi__errpuc("bad format", "Internal error");
+   if (!stbi__hdr_test(s))
+      return stbi__errpuc("not HDR", "Image not of any known type, or corrupt");
+   s->flip = s->opt.flip_vertically;
+   return stbi__hdr_decode(s, x, y, NULL, 3, format);
+}
+
+STBIDEF void *stbi_load_hdr_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int format)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_hdr_main(&s,x,y,format);
+}
+
+STBIDEF void *stbi_load_hdr_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int format)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_hdr_main(&s,x,y,format);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF void *stbi_load_hdr(char const *filename, int *x, int *y, int format)
+{
+   FILE *f;
+   void *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename, NULL)) {
+      result = stbi_load_hdr_from_memory(m.data,m.len,x,y,format);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_hdr_from_file(f,x,y,format);
+   fclose(f);
+   return result;
+}
+
+STBIDEF void *stbi_load_hdr_from_file(FILE *f, int *x, int *y, int format)
+{
+   void *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_hdr_main(&s,x,y,format);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+#endif
 #endif // STBI_NO_HDR
 
 #ifndef STBI_NO_BMP
@@ -7599,8 +12523,17 @@ static int stbi__is_16_main(stbi__context *s)
 #ifndef STBI_NO_STDIO
 STBIDEF int stbi_info(char const *filename, int *x, int *y, int *comp)
 {
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
     int result;
+#ifndef STBI_NO_MMAP
+    stbi__mapped_file m;
+    if (stbi__map_file(&m, filename, NULL)) {
+       result = stbi_info_from_memory(m.data,m.len,x,y,comp);
+       stbi__unmap_file(&m);
+       return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (!f) return stbi__err("can't fopen", "Unable to open file");
     result = stbi_info_from_file(f, x, y, comp);
     fclose(f);
@@ -7620,8 +12553,17 @@ STBIDEF int stbi_info_from_file(FILE *f, int *x, int *y, int *comp)
 
 STBIDEF int stbi_is_16_bit(char const *filename)
 {
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
     int result;
+#ifndef STBI_NO_MMAP
+    stbi__mapped_file m;
+    if (stbi__map_file(&m, filename, NULL)) {
+       result = stbi_is_16_bit_from_memory(m.data,m.len);
+       stbi__unmap_file(&m);
+       return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (!f) return stbi__err("can't fopen", "Unable to open file");
     result = stbi_is_16_bit_from_file(f);
     fclose(f);